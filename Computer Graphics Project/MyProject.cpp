@@ -1,5 +1,5 @@
 #include "MyProject.hpp";
-#include <list>
+#include <random>
 #include <json.hpp>
 
 #define LOG(x) std::cout << x << std::endl;
@@ -8,6 +8,18 @@
 const std::string MODEL_PATH = "models/";
 const std::string TEXTURE_PATH = "textures/";
 
+// built by shaders/compile.bat together with the other shaders
+const std::string INSTANCED_VERT_SHADER = "shaders/instancedVert.spv";
+const std::string BINDLESS_FRAG_SHADER = "shaders/bindlessFrag.spv";
+
+// loaded by the Skybox and the pointer, and prefetched with the scene
+const std::string SKYBOX_MODEL = MODEL_PATH + "skybox_cube.obj";
+const std::string SKYBOX_TEXTURE = TEXTURE_PATH + "skybox toon.png";
+const std::string POINTER_TEXTURE = "white.png"; // in TEXTURE_PATH
+
+// baked by running with --bake-nav-grid, committed with the models
+const std::string NAV_GRID_FILE = MODEL_PATH + "museum.nav";
+
 
 // The uniform buffer object used in this example
 struct GlobalUniformBufferObject {
@@ -61,7 +73,7 @@ struct Triangle {
 		norm = glm::cross(AB, AC);
 	}
 
-	std::optional<glm::vec3> rayIntersection(Ray ray) {
+	std::optional<glm::vec3> rayIntersection(Ray ray) const {
 		float d = glm::dot(norm, A);
 		float perp = glm::dot(ray.direction, norm);
 		if (perp == 0) return std::nullopt;
@@ -90,6 +102,871 @@ struct Triangle {
 	}
 };
 
+// Triangles as a structure of arrays: one vertex and the two edges leaving
+// it, so that the Moller-Trumbore test runs on 8 (AVX) or 4 (SSE) triangles
+// with each instruction. Rays are tested from both sides.
+struct TriangleSoA {
+	std::vector<float> ax, ay, az;
+	std::vector<float> e1x, e1y, e1z;
+	std::vector<float> e2x, e2y, e2z;
+
+	void add(const Triangle& t) {
+		ax.push_back(t.A.x); ay.push_back(t.A.y); az.push_back(t.A.z);
+		e1x.push_back(t.AB.x); e1y.push_back(t.AB.y); e1z.push_back(t.AB.z);
+		e2x.push_back(t.AC.x); e2y.push_back(t.AC.y); e2z.push_back(t.AC.z);
+	}
+
+	size_t size() const {
+		return ax.size();
+	}
+
+	void clear() {
+		for (std::vector<float> *v : { &ax, &ay, &az, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z }) {
+			v->clear();
+		}
+	}
+
+	// Nearest hit of the triangles [first, last) with t in (0, tMax), in
+	// units of ray.direction: returns its index and updates tMax, or -1
+	int32_t intersect(const Ray& ray, size_t first, size_t last, float& tMax) const {
+		const float EPSILON = 1e-12f;
+		int32_t nearest = -1;
+		size_t i = first;
+
+#if SIMD_WIDTH == 8
+		{
+			const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y),
+						 oz = _mm256_set1_ps(ray.origin.z);
+			const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y),
+						 dz = _mm256_set1_ps(ray.direction.z);
+			const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+			const __m256 sign = _mm256_set1_ps(-0.0f), eps = _mm256_set1_ps(EPSILON);
+			for (; i + 8 <= last; i += 8) {
+				__m256 e1x_ = _mm256_loadu_ps(&e1x[i]), e1y_ = _mm256_loadu_ps(&e1y[i]), e1z_ = _mm256_loadu_ps(&e1z[i]);
+				__m256 e2x_ = _mm256_loadu_ps(&e2x[i]), e2y_ = _mm256_loadu_ps(&e2y[i]), e2z_ = _mm256_loadu_ps(&e2z[i]);
+				// p = d x e2, det = e1 . p
+				__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z_), _mm256_mul_ps(dz, e2y_));
+				__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x_), _mm256_mul_ps(dx, e2z_));
+				__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y_), _mm256_mul_ps(dy, e2x_));
+				__m256 det = _mm256_add_ps(_mm256_mul_ps(e1x_, px),
+							 _mm256_add_ps(_mm256_mul_ps(e1y_, py), _mm256_mul_ps(e1z_, pz)));
+				__m256 hit = _mm256_cmp_ps(_mm256_andnot_ps(sign, det), eps, _CMP_GT_OQ);
+				__m256 inv = _mm256_div_ps(one, det);
+				// s = o - a, u = (s . p) / det
+				__m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&ax[i]));
+				__m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&ay[i]));
+				__m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&az[i]));
+				__m256 u = _mm256_mul_ps(inv, _mm256_add_ps(_mm256_mul_ps(sx, px),
+							 _mm256_add_ps(_mm256_mul_ps(sy, py), _mm256_mul_ps(sz, pz))));
+				// q = s x e1, v = (d . q) / det, t = (e2 . q) / det
+				__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z_), _mm256_mul_ps(sz, e1y_));
+				__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x_), _mm256_mul_ps(sx, e1z_));
+				__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y_), _mm256_mul_ps(sy, e1x_));
+				__m256 v = _mm256_mul_ps(inv, _mm256_add_ps(_mm256_mul_ps(dx, qx),
+							 _mm256_add_ps(_mm256_mul_ps(dy, qy), _mm256_mul_ps(dz, qz))));
+				__m256 t = _mm256_mul_ps(inv, _mm256_add_ps(_mm256_mul_ps(e2x_, qx),
+							 _mm256_add_ps(_mm256_mul_ps(e2y_, qy), _mm256_mul_ps(e2z_, qz))));
+				hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+				hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+				hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+				hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+				hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+				int mask = _mm256_movemask_ps(hit);
+				if (mask != 0) {
+					alignas(32) float ts[8];
+					_mm256_store_ps(ts, t);
+					for (int k = 0; k < 8; k++) {
+						if ((mask >> k) & 1 && ts[k] < tMax) {
+							tMax = ts[k];
+							nearest = static_cast<int32_t>(i + k);
+						}
+					}
+				}
+			}
+		}
+#endif
+#if SIMD_WIDTH >= 4
+		{
+			const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y),
+						 oz = _mm_set1_ps(ray.origin.z);
+			const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y),
+						 dz = _mm_set1_ps(ray.direction.z);
+			const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+			const __m128 sign = _mm_set1_ps(-0.0f), eps = _mm_set1_ps(EPSILON);
+			for (; i + 4 <= last; i += 4) {
+				__m128 e1x_ = _mm_loadu_ps(&e1x[i]), e1y_ = _mm_loadu_ps(&e1y[i]), e1z_ = _mm_loadu_ps(&e1z[i]);
+				__m128 e2x_ = _mm_loadu_ps(&e2x[i]), e2y_ = _mm_loadu_ps(&e2y[i]), e2z_ = _mm_loadu_ps(&e2z[i]);
+				__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z_), _mm_mul_ps(dz, e2y_));
+				__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x_), _mm_mul_ps(dx, e2z_));
+				__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y_), _mm_mul_ps(dy, e2x_));
+				__m128 det = _mm_add_ps(_mm_mul_ps(e1x_, px),
+							 _mm_add_ps(_mm_mul_ps(e1y_, py), _mm_mul_ps(e1z_, pz)));
+				__m128 hit = _mm_cmpgt_ps(_mm_andnot_ps(sign, det), eps);
+				__m128 inv = _mm_div_ps(one, det);
+				__m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&ax[i]));
+				__m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&ay[i]));
+				__m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&az[i]));
+				__m128 u = _mm_mul_ps(inv, _mm_add_ps(_mm_mul_ps(sx, px),
+							 _mm_add_ps(_mm_mul_ps(sy, py), _mm_mul_ps(sz, pz))));
+				__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z_), _mm_mul_ps(sz, e1y_));
+				__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x_), _mm_mul_ps(sx, e1z_));
+				__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y_), _mm_mul_ps(sy, e1x_));
+				__m128 v = _mm_mul_ps(inv, _mm_add_ps(_mm_mul_ps(dx, qx),
+							 _mm_add_ps(_mm_mul_ps(dy, qy), _mm_mul_ps(dz, qz))));
+				__m128 t = _mm_mul_ps(inv, _mm_add_ps(_mm_mul_ps(e2x_, qx),
+							 _mm_add_ps(_mm_mul_ps(e2y_, qy), _mm_mul_ps(e2z_, qz))));
+				hit = _mm_and_ps(hit, _mm_cmpge_ps(u, zero));
+				hit = _mm_and_ps(hit, _mm_cmpge_ps(v, zero));
+				hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+				hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, zero));
+				hit = _mm_and_ps(hit, _mm_cmplt_ps(t, _mm_set1_ps(tMax)));
+
+				int mask = _mm_movemask_ps(hit);
+				if (mask != 0) {
+					alignas(16) float ts[4];
+					_mm_store_ps(ts, t);
+					for (int k = 0; k < 4; k++) {
+						if ((mask >> k) & 1 && ts[k] < tMax) {
+							tMax = ts[k];
+							nearest = static_cast<int32_t>(i + k);
+						}
+					}
+				}
+			}
+		}
+#endif
+		for (; i < last; i++) {
+			glm::vec3 e1(e1x[i], e1y[i], e1z[i]);
+			glm::vec3 e2(e2x[i], e2y[i], e2z[i]);
+			glm::vec3 p = glm::cross(ray.direction, e2);
+			float det = glm::dot(e1, p);
+			if (std::abs(det) <= EPSILON) {
+				continue;
+			}
+			float inv = 1.0f / det;
+			glm::vec3 sv = ray.origin - glm::vec3(ax[i], ay[i], az[i]);
+			float u = glm::dot(sv, p) * inv;
+			glm::vec3 q = glm::cross(sv, e1);
+			float v = glm::dot(ray.direction, q) * inv;
+			float t = glm::dot(e2, q) * inv;
+			if (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f && t < tMax) {
+				tMax = t;
+				nearest = static_cast<int32_t>(i);
+			}
+		}
+		return nearest;
+	}
+};
+
+// Bounding volume hierarchy over a set of boxes, built once by splitting
+// the longest axis of their centres at the median. Nodes are stored depth
+// first: an inner node's left child follows it, the right child is at
+// `first`; leaves address `count` entries of `items` from `first`.
+struct BoxBVH {
+	struct Node {
+		glm::vec3 min;
+		glm::vec3 max;
+		uint32_t first; // leaf: first item, inner: right child
+		uint32_t count; // 0 for inner nodes
+	};
+
+	std::vector<uint32_t> items; // box indices in leaf order
+	std::vector<Node> nodes;
+
+	void build(const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs, uint32_t leafSize) {
+		items.resize(mins.size());
+		for (uint32_t i = 0; i < items.size(); i++) {
+			items[i] = i;
+		}
+		nodes.clear();
+		if (items.empty()) {
+			return;
+		}
+
+		nodes.reserve(2 * items.size() / leafSize + 1);
+		buildNode(mins, maxs, leafSize, 0, static_cast<uint32_t>(items.size()));
+	}
+
+	// Calls visit(i) for every leaf entry i whose node overlaps the box,
+	// until visit returns true; returns whether it did
+	template<typename F>
+	bool query(glm::vec3 min, glm::vec3 max, F&& visit) const {
+		if (nodes.empty()) {
+			return false;
+		}
+
+		uint32_t stack[64];
+		uint32_t top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			uint32_t self = stack[--top];
+			const Node& node = nodes[self];
+			if (glm::any(glm::lessThan(max, node.min)) || glm::any(glm::greaterThan(min, node.max))) {
+				continue;
+			}
+			if (node.count > 0) {
+				for (uint32_t i = node.first; i < node.first + node.count; i++) {
+					if (visit(i)) {
+						return true;
+					}
+				}
+			} else {
+				stack[top++] = node.first;
+				stack[top++] = self + 1;
+			}
+		}
+		return false;
+	}
+
+	// Calls hit(first, count, tMax) for the leaves the ray enters before
+	// tMax, nearest first; hit lowers tMax when it finds something closer
+	template<typename F>
+	void raycast(const Ray& ray, float& tMax, F&& hit) const {
+		if (nodes.empty()) {
+			return;
+		}
+
+		glm::vec3 inv = 1.0f / ray.direction;
+		float enter;
+		if (!slab(nodes[0], ray.origin, inv, tMax, enter)) {
+			return;
+		}
+
+		struct Entry {
+			uint32_t node;
+			float enter;
+		};
+		Entry stack[64];
+		uint32_t top = 0;
+		stack[top++] = { 0, enter };
+		while (top > 0) {
+			Entry entry = stack[--top];
+			if (entry.enter > tMax) {
+				continue;
+			}
+
+			const Node& node = nodes[entry.node];
+			if (node.count > 0) {
+				hit(node.first, node.count, tMax);
+				continue;
+			}
+
+			// push the farther child first so the nearer one is opened first
+			float enterLeft, enterRight;
+			bool left = slab(nodes[entry.node + 1], ray.origin, inv, tMax, enterLeft);
+			bool right = slab(nodes[node.first], ray.origin, inv, tMax, enterRight);
+			if (left && right) {
+				if (enterLeft <= enterRight) {
+					stack[top++] = { node.first, enterRight };
+					stack[top++] = { entry.node + 1, enterLeft };
+				} else {
+					stack[top++] = { entry.node + 1, enterLeft };
+					stack[top++] = { node.first, enterRight };
+				}
+			} else if (left) {
+				stack[top++] = { entry.node + 1, enterLeft };
+			} else if (right) {
+				stack[top++] = { node.first, enterRight };
+			}
+		}
+	}
+
+	// Fits the nodes again around the boxes after they moved, keeping the
+	// tree: much cheaper than a build, and as good while the boxes move
+	// together. Children follow their parent, so one backward pass does it
+	void refit(const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs) {
+		for (size_t self = nodes.size(); self-- > 0;) {
+			Node& node = nodes[self];
+			if (node.count > 0) {
+				node.min = glm::vec3(std::numeric_limits<float>::max());
+				node.max = glm::vec3(std::numeric_limits<float>::lowest());
+				for (uint32_t i = node.first; i < node.first + node.count; i++) {
+					node.min = glm::min(node.min, mins[items[i]]);
+					node.max = glm::max(node.max, maxs[items[i]]);
+				}
+			} else {
+				node.min = glm::min(nodes[self + 1].min, nodes[node.first].min);
+				node.max = glm::max(nodes[self + 1].max, nodes[node.first].max);
+			}
+		}
+	}
+
+private:
+	static bool slab(const Node& node, const glm::vec3& origin, const glm::vec3& inv, float tMax, float& enter) {
+		glm::vec3 t0 = (node.min - origin) * inv;
+		glm::vec3 t1 = (node.max - origin) * inv;
+		glm::vec3 lo = glm::min(t0, t1), hi = glm::max(t0, t1);
+		enter = std::max(std::max(lo.x, lo.y), std::max(lo.z, 0.0f));
+		float exit = std::min(std::min(hi.x, hi.y), std::min(hi.z, tMax));
+		return enter <= exit;
+	}
+
+	uint32_t buildNode(const std::vector<glm::vec3>& mins, const std::vector<glm::vec3>& maxs,
+					   uint32_t leafSize, uint32_t first, uint32_t count) {
+		uint32_t self = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({ glm::vec3(std::numeric_limits<float>::max()),
+						  glm::vec3(std::numeric_limits<float>::lowest()), first, count });
+
+		glm::vec3 cmin(std::numeric_limits<float>::max());
+		glm::vec3 cmax(std::numeric_limits<float>::lowest());
+		for (uint32_t i = first; i < first + count; i++) {
+			nodes[self].min = glm::min(nodes[self].min, mins[items[i]]);
+			nodes[self].max = glm::max(nodes[self].max, maxs[items[i]]);
+			glm::vec3 centre = mins[items[i]] + maxs[items[i]];
+			cmin = glm::min(cmin, centre);
+			cmax = glm::max(cmax, centre);
+		}
+		if (count <= leafSize) {
+			return self;
+		}
+
+		glm::vec3 extent = cmax - cmin;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		uint32_t half = count / 2;
+		std::nth_element(items.begin() + first, items.begin() + first + half, items.begin() + first + count,
+			[&](uint32_t a, uint32_t b) { return mins[a][axis] + maxs[a][axis] < mins[b][axis] + maxs[b][axis]; });
+
+		nodes[self].count = 0;
+		buildNode(mins, maxs, leafSize, first, half);
+		nodes[self].first = buildNode(mins, maxs, leafSize, first + half, count - half);
+		return self;
+	}
+};
+
+// Triangle mesh in a BoxBVH over the triangles' bounds. The triangles are
+// kept in leaf order, also as a TriangleSoA for the ray kernel
+struct TriangleBVH {
+	static const uint32_t LEAF_SIZE = SIMD_WIDTH > 4 ? SIMD_WIDTH : 4;
+
+	std::vector<Triangle> triangles;
+	TriangleSoA soa;
+	BoxBVH bvh;
+	std::vector<glm::vec3> refitMins, refitMaxs; // reused by every refit
+
+	void build(std::vector<Triangle> tris) {
+		std::vector<glm::vec3> mins, maxs;
+		for (const Triangle& t : tris) {
+			mins.push_back(glm::min(t.A, glm::min(t.B, t.C)));
+			maxs.push_back(glm::max(t.A, glm::max(t.B, t.C)));
+		}
+		bvh.build(mins, maxs, LEAF_SIZE);
+
+		triangles.clear();
+		soa.clear();
+		for (uint32_t i : bvh.items) {
+			triangles.push_back(tris[i]);
+			soa.add(tris[i]);
+		}
+	}
+
+	// Replaces the triangles with those of shape, given in leaf order,
+	// placed with world, and refits the tree around them
+	void refit(const std::vector<Triangle>& shape, const glm::mat4& world) {
+		refitMins.resize(shape.size());
+		refitMaxs.resize(shape.size());
+		soa.clear();
+		for (uint32_t i = 0; i < shape.size(); i++) {
+			const Triangle& t = triangles[i] = Triangle{
+					world * glm::vec4(shape[i].A, 1.0f),
+					world * glm::vec4(shape[i].B, 1.0f),
+					world * glm::vec4(shape[i].C, 1.0f)
+				};
+			soa.add(t);
+			refitMins[bvh.items[i]] = glm::min(t.A, glm::min(t.B, t.C));
+			refitMaxs[bvh.items[i]] = glm::max(t.A, glm::max(t.B, t.C));
+		}
+		bvh.refit(refitMins, refitMaxs);
+	}
+
+	bool empty() const {
+		return triangles.empty();
+	}
+
+	// world space bounds, valid once built with at least one triangle
+	glm::vec3 min() const {
+		return bvh.nodes[0].min;
+	}
+
+	glm::vec3 max() const {
+		return bvh.nodes[0].max;
+	}
+
+	// Nearest triangle hit by the ray with t in (0, tMax), in units of
+	// ray.direction: returns its index and updates tMax, or -1
+	int32_t raycast(const Ray& ray, float& tMax) const {
+		int32_t nearest = -1;
+		bvh.raycast(ray, tMax, [&](uint32_t first, uint32_t count, float& t) {
+			int32_t hit = soa.intersect(ray, first, first + count, t);
+			if (hit >= 0) {
+				nearest = hit;
+			}
+		});
+		return nearest;
+	}
+
+	// Calls visit(triangle) for every triangle whose leaf overlaps the box,
+	// until visit returns true; returns whether it did
+	template<typename F>
+	bool query(glm::vec3 min, glm::vec3 max, F&& visit) const {
+		return bvh.query(min, max, [&](uint32_t i) { return visit(triangles[i]); });
+	}
+};
+
+// 2D occupancy grid of the places the player can stand, baked offline
+// (--bake-nav-grid) from the floor and obstacle triangles and committed
+// next to the models. A cell is walkable when there is floor below the
+// eye and no obstacle within the player radius between the knees and the
+// head; Player::move walks on it one cell at a time, sliding along the
+// walls, before sweeping its collider against what moves.
+const uint32_t NAV_GRID_MAGIC = 0x4e415647; // "NAVG"
+const uint32_t NAV_GRID_VERSION = 2;
+
+struct NavGridHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t depth;
+	float originX;
+	float originZ;
+	float cellSize;
+	uint32_t padding;
+	uint64_t sourceHash; // of the files and settings it was baked from
+};
+
+struct NavGrid {
+	const float CELL_SIZE = 0.1f;
+	const float RADIUS = 0.3f; // distance kept from obstacles
+	const float KNEE_HEIGHT = 0.3f; // lower obstacles are stepped over
+	const float HEAD_HEIGHT = 0.2f; // above the eye
+	const float FLOOR_DEPTH = 1.5f; // below the eye
+	const uint32_t MAX_STEPS = 16; // cells walked in one move
+
+	glm::vec2 origin = glm::vec2(0.0f);
+	float cellSize = 0.0f;
+	uint32_t width = 0, depth = 0;
+	std::vector<uint8_t> cells; // 1 where walkable
+
+	// Loads the grid baked in file, which must be there and baked from
+	// sources of this hash
+	void init(const std::string& file, uint64_t hash) {
+		if (!load(file, hash)) {
+			throw std::runtime_error(file + " is missing or was baked from other sources: run with --bake-nav-grid");
+		}
+		std::cout << file << ": " << width << "x" << depth << " cells" << std::endl;
+	}
+
+	// Bakes the grid and saves it with the hash of its sources
+	void bake(const std::string& file, uint64_t hash, const std::vector<Triangle>& obstacles,
+			  const std::vector<Triangle>& floors, float eyeHeight) {
+		auto start = std::chrono::steady_clock::now();
+		bake(obstacles, floors, eyeHeight);
+		float ms = std::chrono::duration<float, std::chrono::milliseconds::period>(
+			std::chrono::steady_clock::now() - start).count();
+		save(file, hash);
+		std::cout << file << ": baked " << width << "x" << depth << " cells in " << ms << " ms" << std::endl;
+	}
+
+	// FNV-1a of the bytes of the files the grid is baked from, and of the
+	// settings: the files are read, not parsed
+	uint64_t sourceHash(const std::vector<std::string>& files, float eyeHeight) const {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		auto mix = [&](const void *data, size_t size) {
+			for (size_t i = 0; i < size; i++) {
+				hash = (hash ^ static_cast<const uint8_t*>(data)[i]) * 0x100000001b3ull;
+			}
+		};
+		for (const std::string& file : files) {
+			std::ifstream in(file, std::ios::binary);
+			if (!in.is_open()) {
+				throw std::runtime_error("failed to open " + file);
+			}
+			std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			size_t size = bytes.size();
+			mix(&size, sizeof(size));
+			mix(bytes.data(), bytes.size());
+		}
+		float settings[] = { eyeHeight, CELL_SIZE, RADIUS, KNEE_HEIGHT, HEAD_HEIGHT, FLOOR_DEPTH };
+		mix(settings, sizeof(settings));
+		return hash;
+	}
+
+	bool walkable(glm::vec3 pos) const {
+		glm::vec2 cell = glm::floor((glm::vec2(pos.x, pos.z) - origin) / cellSize);
+		if (cell.x < 0.0f || cell.y < 0.0f || cell.x >= width || cell.y >= depth) {
+			return false;
+		}
+		return cells[static_cast<uint32_t>(cell.y) * width + static_cast<uint32_t>(cell.x)] != 0;
+	}
+
+	// Where a horizontal move by delta from pos ends: cell sized steps that
+	// drop the blocked axis at walls, at most MAX_STEPS of them. A player
+	// that is not on the grid is put back on the nearest walkable cell
+	glm::vec3 walk(glm::vec3 pos, glm::vec3 delta) const {
+		if (!walkable(pos)) {
+			return nearestWalkable(pos);
+		}
+
+		float length = glm::length(glm::vec2(delta.x, delta.z));
+		if (length == 0.0f) {
+			return pos;
+		}
+		uint32_t steps = std::min(MAX_STEPS, static_cast<uint32_t>(std::ceil(length / cellSize)));
+		glm::vec3 step = glm::vec3(delta.x, 0.0f, delta.z) * (std::min(length, MAX_STEPS * cellSize) / length / steps);
+
+		for (uint32_t i = 0; i < steps; i++) {
+			if (walkable(pos + step)) {
+				pos += step;
+			} else if (walkable(pos + glm::vec3(step.x, 0.0f, 0.0f))) {
+				pos.x += step.x;
+			} else if (walkable(pos + glm::vec3(0.0f, 0.0f, step.z))) {
+				pos.z += step.z;
+			} else {
+				break;
+			}
+		}
+		return pos;
+	}
+
+	// Centre of the walkable cell nearest to pos, searched in growing
+	// square rings around the cell of pos, clamped to the grid; pos when
+	// no cell is walkable
+	glm::vec3 nearestWalkable(glm::vec3 pos) const {
+		glm::vec2 point(pos.x, pos.z);
+		glm::ivec2 cell = glm::clamp(glm::ivec2(glm::floor((point - origin) / cellSize)),
+									 glm::ivec2(0), glm::ivec2(width - 1, depth - 1));
+		glm::vec3 nearest = pos;
+		float best = std::numeric_limits<float>::max();
+		int rings = static_cast<int>(std::max(width, depth));
+		// a cell of ring r is at least r - 1 cells away from the clamped cell
+		for (int r = 0; r < rings && (r - 1) * cellSize < best; r++) {
+			for (int dz = -r; dz <= r; dz++) {
+				for (int dx = -r; dx <= r; dx += (dz == -r || dz == r) ? 1 : 2 * r) {
+					int x = cell.x + dx, z = cell.y + dz;
+					if (x < 0 || z < 0 || x >= static_cast<int>(width) || z >= static_cast<int>(depth) ||
+						!cells[z * width + x]) {
+						continue;
+					}
+					glm::vec2 centre = origin + (glm::vec2(x, z) + 0.5f) * cellSize;
+					float distance = glm::distance(centre, point);
+					if (distance < best) {
+						best = distance;
+						nearest = glm::vec3(centre.x, pos.y, centre.y);
+					}
+				}
+			}
+		}
+		return nearest;
+	}
+
+private:
+	void bake(const std::vector<Triangle>& obstacles, const std::vector<Triangle>& floors, float eyeHeight) {
+		// the grid covers the floors and the obstacles with a margin of a cell
+		glm::vec2 min(std::numeric_limits<float>::max()), max(std::numeric_limits<float>::lowest());
+		for (const std::vector<Triangle> *list : { &obstacles, &floors }) {
+			for (const Triangle& t : *list) {
+				for (const glm::vec3& v : { t.A, t.B, t.C }) {
+					min = glm::min(min, glm::vec2(v.x, v.z));
+					max = glm::max(max, glm::vec2(v.x, v.z));
+				}
+			}
+		}
+		cellSize = CELL_SIZE;
+		origin = min - cellSize;
+		width = static_cast<uint32_t>(std::ceil((max.x - origin.x) / cellSize)) + 1;
+		depth = static_cast<uint32_t>(std::ceil((max.y - origin.y) / cellSize)) + 1;
+
+		// floor below the eye
+		TriangleBVH ground;
+		ground.build(floors);
+		cells.assign(width * depth, 0);
+		for (uint32_t z = 0; z < depth; z++) {
+			for (uint32_t x = 0; x < width; x++) {
+				glm::vec2 centre = origin + (glm::vec2(x, z) + 0.5f) * cellSize;
+				float t = FLOOR_DEPTH;
+				cells[z * width + x] = ground.raycast(Ray{ glm::vec3(centre.x, eyeHeight, centre.y),
+														   glm::vec3(0.0f, -1.0f, 0.0f) }, t) >= 0;
+			}
+		}
+
+		// cells crossed by an obstacle between the knees and the head
+		float bottom = eyeHeight - FLOOR_DEPTH + KNEE_HEIGHT, top = eyeHeight + HEAD_HEIGHT;
+		std::vector<uint8_t> blocked(width * depth, 0);
+		for (const Triangle& t : obstacles) {
+			glm::vec3 tmin = glm::min(t.A, glm::min(t.B, t.C)), tmax = glm::max(t.A, glm::max(t.B, t.C));
+			if (tmax.y < bottom || tmin.y > top) {
+				continue;
+			}
+			glm::ivec2 first = glm::max(glm::ivec2(glm::floor((glm::vec2(tmin.x, tmin.z) - origin) / cellSize)), 0);
+			glm::ivec2 last = glm::min(glm::ivec2(glm::floor((glm::vec2(tmax.x, tmax.z) - origin) / cellSize)),
+									   glm::ivec2(width - 1, depth - 1));
+			for (int z = first.y; z <= last.y; z++) {
+				for (int x = first.x; x <= last.x; x++) {
+					glm::vec2 centre = origin + (glm::vec2(x, z) + 0.5f) * cellSize;
+					if (!blocked[z * width + x] &&
+						overlaps(t, glm::vec3(centre.x, (bottom + top) / 2, centre.y),
+								 glm::vec3(cellSize / 2, (top - bottom) / 2, cellSize / 2))) {
+						blocked[z * width + x] = 1;
+					}
+				}
+			}
+		}
+
+		// keep the player radius away from them
+		int reach = static_cast<int>(std::ceil(RADIUS / cellSize));
+		for (int z = 0; z < static_cast<int>(depth); z++) {
+			for (int x = 0; x < static_cast<int>(width); x++) {
+				if (!blocked[z * width + x]) {
+					continue;
+				}
+				for (int dz = -reach; dz <= reach; dz++) {
+					for (int dx = -reach; dx <= reach; dx++) {
+						int cx = x + dx, cz = z + dz;
+						if (cx >= 0 && cz >= 0 && cx < static_cast<int>(width) && cz < static_cast<int>(depth) &&
+							(dx * dx + dz * dz) * cellSize * cellSize <= RADIUS * RADIUS) {
+							cells[cz * width + cx] = 0;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Separating axis test of a triangle against a box
+	static bool overlaps(const Triangle& t, glm::vec3 centre, glm::vec3 half) {
+		glm::vec3 v[3] = { t.A - centre, t.B - centre, t.C - centre };
+		glm::vec3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+
+		auto separates = [&](glm::vec3 axis) {
+			float p0 = glm::dot(v[0], axis), p1 = glm::dot(v[1], axis), p2 = glm::dot(v[2], axis);
+			float r = glm::dot(half, glm::abs(axis));
+			return std::min(p0, std::min(p1, p2)) > r || std::max(p0, std::max(p1, p2)) < -r;
+		};
+
+		for (int i = 0; i < 3; i++) {
+			glm::vec3 axis(0.0f);
+			axis[i] = 1.0f;
+			if (separates(axis)) {
+				return false;
+			}
+			for (const glm::vec3& edge : edges) {
+				if (separates(glm::cross(axis, edge))) {
+					return false;
+				}
+			}
+		}
+		return !separates(t.norm);
+	}
+
+	bool load(const std::string& file, uint64_t hash) {
+		std::ifstream in(file, std::ios::binary);
+		if (!in.is_open()) {
+			return false;
+		}
+
+		NavGridHeader header;
+		if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+			header.magic != NAV_GRID_MAGIC || header.version != NAV_GRID_VERSION ||
+			header.sourceHash != hash) {
+			return false;
+		}
+
+		if (header.width == 0 || header.depth == 0 || !(header.cellSize > 0.0f)) {
+			return false;
+		}
+		cells.resize(static_cast<size_t>(header.width) * header.depth);
+		if (!in.read(reinterpret_cast<char*>(cells.data()), cells.size())) {
+			cells.clear();
+			return false;
+		}
+		origin = glm::vec2(header.originX, header.originZ);
+		cellSize = header.cellSize;
+		width = header.width;
+		depth = header.depth;
+		return true;
+	}
+
+	void save(const std::string& file, uint64_t hash) const {
+		NavGridHeader header{ NAV_GRID_MAGIC, NAV_GRID_VERSION, width, depth,
+							  origin.x, origin.y, cellSize, 0, hash };
+		std::ofstream out(file, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			throw std::runtime_error("failed to write " + file);
+		}
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(cells.data()), cells.size());
+	}
+};
+
+// Swept ellipsoid against the boundary triangles, with sliding: the body
+// of the player from the knees to above the eye. The sweep runs in the
+// space where the ellipsoid is a unit sphere; the triangles it can touch
+// come from a BVH query of the swept box.
+struct EllipsoidCollider {
+	const float VERY_CLOSE = 0.005f; // kept between the body and the walls
+	const uint32_t MAX_ITERATIONS = 5; // slides per move
+
+	glm::vec3 radius = glm::vec3(0.3f, 0.5f, 0.3f);
+	float eyeOffset = 0.35f; // from the centre of the ellipsoid up to the eye
+	TriangleBVH triangles;
+	// colliders of objects that move, refitted in place by their owner
+	std::vector<const TriangleBVH*> moving;
+
+	void build(std::vector<Triangle> boundaries) {
+		triangles.build(std::move(boundaries));
+	}
+
+	// Where a move by delta of the eye at pos ends, sliding along what it
+	// touches and staying at the same height
+	glm::vec3 move(glm::vec3 pos, glm::vec3 delta) const {
+		glm::vec3 centre = (pos - glm::vec3(0.0f, eyeOffset, 0.0f)) / radius;
+		glm::vec3 velocity = glm::vec3(delta.x, 0.0f, delta.z) / radius;
+
+		for (uint32_t i = 0; i < MAX_ITERATIONS && glm::length(velocity) > VERY_CLOSE; i++) {
+			float t;
+			glm::vec3 contact;
+			if (!sweep(centre, velocity, t, contact)) {
+				centre += velocity;
+				break;
+			}
+
+			// stop just short of the contact, then slide along the tangent
+			// plane there with what is left of the move
+			glm::vec3 destination = centre + velocity;
+			glm::vec3 direction = glm::normalize(velocity);
+			float distance = t * glm::length(velocity);
+			if (distance >= VERY_CLOSE) {
+				centre += direction * (distance - VERY_CLOSE);
+				contact -= direction * VERY_CLOSE;
+			}
+			glm::vec3 normal = glm::normalize(centre - contact);
+			destination -= glm::dot(destination - contact, normal) * normal;
+			velocity = destination - contact;
+			velocity.y = 0.0f;
+		}
+
+		return centre * radius + glm::vec3(0.0f, eyeOffset, 0.0f);
+	}
+
+private:
+	// Earliest contact of the unit sphere at centre moving by velocity:
+	// the fraction t of the move and the touched point
+	bool sweep(glm::vec3 centre, glm::vec3 velocity, float& t, glm::vec3& contact) const {
+		glm::vec3 from = centre * radius, to = (centre + velocity) * radius;
+		glm::vec3 min = glm::min(from, to) - radius, max = glm::max(from, to) + radius;
+
+		bool found = false;
+		t = 1.0f;
+		auto visit = [&](const Triangle& tri) {
+			glm::vec3 p0 = tri.A / radius, p1 = tri.B / radius, p2 = tri.C / radius;
+			found = sweepTriangle(centre, velocity, p0, p1, p2, t, contact) || found;
+			return false;
+		};
+		triangles.query(min, max, visit);
+		for (const TriangleBVH *obstacle : moving) {
+			obstacle->query(min, max, visit);
+		}
+		return found;
+	}
+
+	// Smallest root of a t^2 + b t + c in [0, limit)
+	static bool lowestRoot(float a, float b, float c, float limit, float& root) {
+		float determinant = b * b - 4.0f * a * c;
+		if (determinant < 0.0f || a == 0.0f) {
+			return false;
+		}
+		float s = std::sqrt(determinant);
+		float r1 = (-b - s) / (2.0f * a), r2 = (-b + s) / (2.0f * a);
+		if (r1 > r2) {
+			std::swap(r1, r2);
+		}
+		if (r1 > 0.0f && r1 < limit) {
+			root = r1;
+			return true;
+		}
+		if (r2 > 0.0f && r2 < limit) {
+			root = r2;
+			return true;
+		}
+		return false;
+	}
+
+	// Updates t and contact when the sphere touches the triangle earlier
+	static bool sweepTriangle(glm::vec3 base, glm::vec3 velocity, glm::vec3 p0, glm::vec3 p1, glm::vec3 p2,
+							  float& t, glm::vec3& contact) {
+		glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+		if (glm::dot(normal, normal) == 0.0f) {
+			return false;
+		}
+		normal = glm::normalize(normal);
+		float distance = glm::dot(normal, base - p0);
+		if (distance < 0.0f) {
+			// triangles are solid from both sides
+			normal = -normal;
+			distance = -distance;
+		}
+		// moving along or away from the plane cannot run into the triangle:
+		// this also lets a sphere that ended up inside it leave
+		float approach = glm::dot(normal, velocity);
+		if (approach >= 0.0f) {
+			return false;
+		}
+
+		// the sphere touches the plane from t0 on
+		float t0 = (1.0f - distance) / approach;
+		if (t0 > 1.0f || t0 >= t) {
+			return false;
+		}
+		t0 = std::max(t0, 0.0f);
+
+		// where it first touches the plane inside the triangle
+		glm::vec3 point = base - normal + t0 * velocity;
+		glm::vec3 c0 = glm::cross(p1 - p0, point - p0);
+		glm::vec3 c1 = glm::cross(p2 - p1, point - p1);
+		glm::vec3 c2 = glm::cross(p0 - p2, point - p2);
+		if (glm::dot(c0, c1) >= 0.0f && glm::dot(c1, c2) >= 0.0f) {
+			t = t0;
+			contact = point;
+			return true;
+		}
+
+		// otherwise it can only touch a corner or an edge
+		bool hit = false;
+		float speed2 = glm::dot(velocity, velocity);
+		float root;
+		for (const glm::vec3& p : { p0, p1, p2 }) {
+			float b = 2.0f * glm::dot(velocity, base - p);
+			float c = glm::dot(p - base, p - base) - 1.0f;
+			if (lowestRoot(speed2, b, c, t, root)) {
+				t = root;
+				contact = p;
+				hit = true;
+			}
+		}
+		glm::vec3 corners[3] = { p0, p1, p2 };
+		for (int i = 0; i < 3; i++) {
+			glm::vec3 a = corners[i], edge = corners[(i + 1) % 3] - a;
+			glm::vec3 toBase = a - base;
+			float edge2 = glm::dot(edge, edge);
+			float edgeVelocity = glm::dot(edge, velocity);
+			float edgeBase = glm::dot(edge, toBase);
+			float qa = edge2 * -speed2 + edgeVelocity * edgeVelocity;
+			float qb = edge2 * (2.0f * glm::dot(velocity, toBase)) - 2.0f * edgeVelocity * edgeBase;
+			float qc = edge2 * (1.0f - glm::dot(toBase, toBase)) + edgeBase * edgeBase;
+			if (lowestRoot(qa, qb, qc, t, root)) {
+				// inside the segment?
+				float f = (edgeVelocity * root - edgeBase) / edge2;
+				if (f >= 0.0f && f <= 1.0f) {
+					t = root;
+					contact = a + f * edge;
+					hit = true;
+				}
+			}
+		}
+		return hit;
+	}
+};
+
 struct Camera {
 	void init(glm::vec3 angles, glm::vec3 position, float near, float far, float fov, float aspectRatio) {
 		this->angles = angles;
@@ -153,7 +1030,9 @@ private:
 };
 
 struct Player {
-	std::list<Triangle> boundaries;
+	std::vector<Triangle> boundaries; // collected while loading, moved into collider
+	EllipsoidCollider collider;
+	NavGrid navGrid;
 	Camera camera;
 
 	const float movementSpeed = 3.0f;
@@ -199,7 +1078,21 @@ struct Player {
 	}
 
 	void addTriangle(Triangle t) {
-		boundaries.push_front(t);
+		boundaries.push_back(t);
+	}
+
+	// An obstacle whose collider is refitted while it moves: swept against
+	// where it is at each step, and left out of the baked navGrid
+	void addMovingObstacle(const TriangleBVH *obstacle) {
+		collider.moving.push_back(obstacle);
+	}
+
+	// once every boundary has been added and the camera placed
+	void buildCollision() {
+		collider.build(std::move(boundaries));
+		std::cout << "Collision BVH: " << collider.triangles.triangles.size() << " triangles, "
+				  << collider.triangles.bvh.nodes.size() << " nodes" << std::endl;
+		boundaries.clear();
 	}
 
 	glm::vec3 getPosition() {
@@ -208,23 +1101,18 @@ struct Player {
 
 private:
 	void move(glm::vec3 dir) {
-		// check for each boundary if there is a collision -> if yes then cant move in this direction
-		for (Triangle& t : boundaries) {
-			auto intersec = t.rayIntersection(Ray{ camera.getCamPos(), dir });
-			if (
-				intersec && 
-				glm::length(*intersec - camera.getCamPos()) <= (glm::length(dir) + 0.5f) && // intersection 
-				glm::dot(*intersec - camera.getCamPos(), dir) > 0 // intersection same direction of the movement
-			) { return; }
-		}
-
-		camera.move(dir);
+		glm::vec3 pos = camera.getCamPos();
+		// the grid keeps the player on the floor and away from the walls in
+		// constant time per step; the sweep then stops it at what moves
+		glm::vec3 walked = navGrid.walk(pos, dir);
+		glm::vec3 end = collider.move(pos, walked - pos);
+		camera.move(end - pos);
 	}
 };
 
 struct Circle {
 	Model2D model;
-	Texture texture;
+	Texture *texture;
 	DescriptorSet descSet;
 
 	UniformBufferObject ubo;
@@ -246,10 +1134,10 @@ struct Circle {
 
 
 		model.init(bp, ver, index);
-		texture.init(bp, TEXTURE_PATH + textureString);
+		texture = bp->acquireTexture(TEXTURE_PATH + textureString);
 		descSet.init(bp, DSL, {
 			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
+			{1, TEXTURE, 0, texture}
 			});
 
 		ubo.worldMatrix = glm::scale(glm::mat4(1), glm::vec3(9.0f/16.0f, 1.0f, 1.0f));
@@ -257,36 +1145,22 @@ struct Circle {
 
 	void cleanup() {
 		descSet.cleanup();
-		texture.cleanup();
+		texture->BP->releaseTexture(texture);
 		model.cleanup();
 	}
 
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 0, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr
-		);
-
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+	void submit(RenderQueue& queue, Pipeline *pipeline) {
+		queue.submit(RenderQueue::LAYER_OVERLAY, pipeline, &descSet, 0, model, nullptr, 0.0f);
 	}
 
-	void updateUbo(int currentImage, VkDevice device) {
-		void* data;
-		vkMapMemory(device, descSet.uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, descSet.uniformBuffersMemory[0][currentImage]);
+	void updateUbo(int currentImage) {
+		memcpy(descSet.uniformBuffersMapped[0][currentImage], &ubo, sizeof(ubo));
 	}
 };
 
 struct ArtDescription {
 	Model2D model;
-	Texture texture;
+	Texture *texture;
 	DescriptorSet descSet;
 
 	UniformBufferObject ubo;
@@ -312,10 +1186,10 @@ struct ArtDescription {
 		ver.push_back(Vertex{ {-0.7f, 0.7f, 0.0f}, {0, 0, 1}, {0, 1} }); index.push_back(5);
 
 		model.init(bp, ver, index);
-		texture.init(bp, TEXTURE_PATH + textureString);
+		texture = bp->acquireTexture(TEXTURE_PATH + textureString);
 		descSet.init(bp, DSL, {
 			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
+			{1, TEXTURE, 0, texture}
 		});
 
 		ubo.worldMatrix = glm::translate(glm::mat4(1), glm::vec3(0, 2, 0));
@@ -323,438 +1197,834 @@ struct ArtDescription {
 
 	void cleanup() {
 		descSet.cleanup();
-		texture.cleanup();
+		texture->BP->releaseTexture(texture);
 		model.cleanup();
 	}
 
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 0, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr
-		);
-
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+	void submit(RenderQueue& queue, Pipeline *pipeline) {
+		queue.submit(RenderQueue::LAYER_OVERLAY, pipeline, &descSet, 0, model, nullptr, 0.0f);
 	}
 
-	void updateUbo(int currentImage, VkDevice device) {
-		void* data;
-		vkMapMemory(device, descSet.uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, descSet.uniformBuffersMemory[0][currentImage]);
+	void updateUbo(int currentImage) {
+		memcpy(descSet.uniformBuffersMapped[0][currentImage], &ubo, sizeof(ubo));
 	}
 };
 
-enum Art { PICTURE, STATUE };
+// Every object of the scene is an entity: an index into dense arrays, one
+// per component, so that culling, picking and submission walk contiguous
+// memory. Components an entity lacks hold NONE (handles) or nullptr.
+// The arrays only grow while loading: pointers into them (the material
+// sets handed to the render queue and the instance batches) stay valid
+// once the scene is complete.
+// Entities form a hierarchy: each has a transform local to its parent,
+// created before it, and caches its world matrix. setLocal marks an
+// entity dirty; updateTransforms then recomputes it and what hangs below
+// it, and moves their colliders, leaving the rest of the scene alone.
+typedef uint32_t Entity;
+
+struct SceneStore {
+	static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+	enum Flags : uint8_t {
+		INSTANCED = 1, // drawn by the InstanceBatches when they are enabled
+		OBSTACLE = 2, // its collider stops the player
+		PICKABLE = 4, // its collider is the click area of its description
+		IN_ROOM = 8, // culled with the hall that holds its centre
+		MOVING = 16 // its transform changes after loading
+	};
+
+	// world transforms, as the shaders read them
+	std::vector<PushConstantObject> transform;
+	// the hierarchy: parent entity and transform relative to it
+	std::vector<Entity> parent;
+	std::vector<std::vector<Entity>> children;
+	std::vector<glm::mat4> local;
+	std::vector<uint8_t> dirty;
+	std::vector<Entity> dirtyEntities; // set by setLocal since the last update
+	std::vector<Entity> updateStack; // reused by updateTransforms
+	// mesh and material handles
+	std::vector<Model*> mesh;
+	std::vector<Texture*> texture;
+	std::vector<DescriptorSet> material;
+	// box in the scene's FrustumCuller
+	std::vector<uint32_t> bounds;
+	// handle returned by InstanceBatches::add
+	std::vector<uint32_t> instance;
+	std::vector<uint8_t> flags;
+	// handles into colliders and descriptions
+	std::vector<uint32_t> collider;
+	std::vector<uint32_t> description;
+
+	std::vector<TriangleBVH> colliders; // world space triangles
+	std::vector<std::vector<Triangle>> colliderShapes; // model space, in the colliders' order
+	std::vector<ArtDescription> descriptions;
+	std::vector<uint8_t> descriptionVisible;
+
+	uint32_t size() const {
+		return static_cast<uint32_t>(transform.size());
+	}
 
-struct Artwork {
-	std::string textureName; // texture
-	std::string modelName; // model
-	std::string collisionModel; // clickable area
-	std::string descrTextureName; // description image
-	Art type;
-	float reflectance;
+	Entity create(const glm::mat4& localMat, float reflectance, uint8_t entityFlags = 0,
+				  Entity parentEntity = NONE) {
+		glm::mat4 world = parentEntity == NONE ? localMat : transform[parentEntity].worldMat * localMat;
+		transform.push_back({ world, reflectance });
+		parent.push_back(parentEntity);
+		children.emplace_back();
+		if (parentEntity != NONE) {
+			children[parentEntity].push_back(size() - 1);
+		}
+		local.push_back(localMat);
+		dirty.push_back(0);
+		mesh.push_back(nullptr);
+		texture.push_back(nullptr);
+		material.emplace_back();
+		bounds.push_back(0);
+		instance.push_back(NONE);
+		flags.push_back(entityFlags);
+		collider.push_back(NONE);
+		description.push_back(NONE);
+		return size() - 1;
+	}
+
+	// Instanced entities with bindless textures need no material set
+	void setMesh(Entity e, BaseProject *bp, DescriptorSetLayout *DSL,
+				 const std::string& modelFile, const std::string& textureFile) {
+		mesh[e] = bp->acquireModel(modelFile);
+		texture[e] = bp->acquireTexture(textureFile);
+		if (!(flags[e] & INSTANCED) || !bp->usesBindlessTextures()) {
+			material[e].init(bp, DSL, {
+				{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
+				{1, TEXTURE, 0, texture[e]}
+				});
+		}
+	}
 
-	std::vector<float> translate;
-	std::vector<float> rotate;
-	std::vector<float> scale;
+	// Model space triangles, placed with the entity's transform
+	void setCollider(Entity e, const std::vector<Triangle>& triangles) {
+		collider[e] = static_cast<uint32_t>(colliders.size());
+		colliders.emplace_back();
+		colliders.back().build(place(triangles, transform[e].worldMat));
 
-	std::list<Triangle> body;
+		colliderShapes.emplace_back();
+		for (uint32_t i : colliders.back().bvh.items) {
+			colliderShapes.back().push_back(triangles[i]);
+		}
+	}
 
-	Model model;
-	Texture texture;
-	DescriptorSet descSet;
-	ArtDescription description;
-	PushConstantObject pco;
+	void loadCollider(Entity e, BaseProject *bp, const std::string& file) {
+		const std::vector<glm::vec3>& vertices = bp->loadCollider(file);
+		std::vector<Triangle> triangles;
+		for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+			triangles.push_back(Triangle{ vertices[i], vertices[i + 1], vertices[i + 2] });
+		}
+		setCollider(e, triangles);
+	}
 
-	bool descriptionVisible = false;
+	void setLocal(Entity e, const glm::mat4& localMat) {
+		local[e] = localMat;
+		if (!dirty[e]) {
+			dirty[e] = 1;
+			dirtyEntities.push_back(e);
+		}
+	}
 
-	void init(DescriptorSetLayout *ubo_dsl, BaseProject *bp) {
-		model.init(bp, MODEL_PATH + modelName);
-		texture.init(bp, TEXTURE_PATH + textureName);
-		descSet.init(bp, ubo_dsl, {
-			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
-			});
+	// Recomputes the world transforms of the dirty entities and of those
+	// below them, and refits their colliders; appends them to changed so
+	// that their owners can follow. The rest of the scene is not visited
+	void updateTransforms(std::vector<Entity>& changed) {
+		for (Entity root : dirtyEntities) {
+			// below another dirty entity: updated together with it
+			bool below = false;
+			for (Entity a = parent[root]; a != NONE && !below; a = parent[a]) {
+				below = dirty[a] != 0;
+			}
+			if (below) {
+				continue;
+			}
 
-		pco.worldMat = glm::translate(glm::mat4(1), { translate[0], translate[1], translate[2] }) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[1]), glm::vec3(0, 1, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[0]), glm::vec3(1, 0, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[2]), glm::vec3(0, 0, 1)) *
-			glm::scale(glm::mat4(1), { scale[0], scale[1], scale[2] });
+			updateStack.push_back(root);
+			while (!updateStack.empty()) {
+				Entity e = updateStack.back();
+				updateStack.pop_back();
 
-		//Specular values
-		pco.reflectance = reflectance;
-		
+				transform[e].worldMat = parent[e] == NONE ? local[e] : transform[parent[e]].worldMat * local[e];
+				if (collider[e] != NONE) {
+					colliders[collider[e]].refit(colliderShapes[collider[e]], transform[e].worldMat);
+				}
+				changed.push_back(e);
+				updateStack.insert(updateStack.end(), children[e].begin(), children[e].end());
+			}
+		}
 
-		loadClickArea(MODEL_PATH + collisionModel);
-		description.init(ubo_dsl, bp, "descriptions/" + descrTextureName);
+		for (Entity e : dirtyEntities) {
+			dirty[e] = 0;
+		}
+		dirtyEntities.clear();
 	}
 
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	void setDescription(Entity e, BaseProject *bp, DescriptorSetLayout *DSL, const std::string& textureFile) {
+		description[e] = static_cast<uint32_t>(descriptions.size());
+		descriptions.emplace_back();
+		descriptions.back().init(DSL, bp, textureFile);
+		descriptionVisible.push_back(0);
+	}
 
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 1, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr);
+	void showDescription(Entity e) {
+		descriptions[description[e]].setVisible();
+		descriptionVisible[description[e]] = 1;
+	}
 
-		// push constant before drawing the picture
-		vkCmdPushConstants(commandBuffer, pipeline.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-			0, sizeof(PushConstantObject), &pco
-		);
+	void hideDescriptions() {
+		for (uint32_t i = 0; i < descriptions.size(); i++) {
+			descriptions[i].setHidden();
+			descriptionVisible[i] = 0;
+		}
+	}
 
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+	// Nearest point of the entity's collider in front of the ray, closer
+	// than distance (with ray.direction normalized), which it then holds
+	bool raycast(Entity e, const Ray& ray, float& distance) const {
+		return collider[e] != NONE && colliders[collider[e]].raycast(ray, distance) >= 0;
 	}
 
 	void cleanup() {
-		descSet.cleanup();
-		texture.cleanup();
-		model.cleanup();
-		description.cleanup();
-	}
-
-	void loadClickArea(std::string file) {
-		tinyobj::attrib_t attrib;
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string warn, err;
-
-		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-			file.c_str())) {
-			throw std::runtime_error(warn + err);
-		}
-
-		for (const auto& shape : shapes) {
-			for (int i = 0; i < shape.mesh.indices.size(); i += 3) {
-				addTriangle(Triangle{
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 2], 1.0f),
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 2], 1.0f),
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 2], 1.0f),
-					});
+		for (Entity e = 0; e < size(); e++) {
+			material[e].cleanup();
+			if (texture[e] != nullptr) {
+				texture[e]->BP->releaseTexture(texture[e]);
+			}
+			if (mesh[e] != nullptr) {
+				mesh[e]->BP->releaseModel(mesh[e]);
 			}
 		}
-	}
+		for (ArtDescription& d : descriptions) {
+			d.cleanup();
+		}
 
-	void handleClick() {
-		description.setVisible();
+		transform.clear();
+		parent.clear();
+		children.clear();
+		local.clear();
+		dirty.clear();
+		dirtyEntities.clear();
+		mesh.clear();
+		texture.clear();
+		material.clear();
+		bounds.clear();
+		instance.clear();
+		flags.clear();
+		collider.clear();
+		description.clear();
+		colliders.clear();
+		colliderShapes.clear();
+		descriptions.clear();
+		descriptionVisible.clear();
 	}
 
-	void hideDescription() {
-		description.setHidden();
+private:
+	static std::vector<Triangle> place(const std::vector<Triangle>& triangles, const glm::mat4& world) {
+		std::vector<Triangle> placed;
+		placed.reserve(triangles.size());
+		for (const Triangle& t : triangles) {
+			placed.push_back(Triangle{
+					world * glm::vec4(t.A, 1.0f),
+					world * glm::vec4(t.B, 1.0f),
+					world * glm::vec4(t.C, 1.0f)
+				});
+		}
+		return placed;
 	}
+};
 
-	void addTriangle(Triangle t) {
-		body.push_front(t);
+// translate/rotate/scale of an object in config/artworks.json, rotations
+// in degrees applied around y, then x, then z
+glm::mat4 worldMatrix(const nlohmann::json& j) {
+	std::vector<float> translate = j.at("translate").get<std::vector<float>>();
+	std::vector<float> rotate = j.at("rotate").get<std::vector<float>>();
+	std::vector<float> scale = j.at("scale").get<std::vector<float>>();
+
+	return glm::translate(glm::mat4(1), { translate[0], translate[1], translate[2] }) *
+		glm::rotate(glm::mat4(1), glm::radians(rotate[1]), glm::vec3(0, 1, 0)) *
+		glm::rotate(glm::mat4(1), glm::radians(rotate[0]), glm::vec3(1, 0, 0)) *
+		glm::rotate(glm::mat4(1), glm::radians(rotate[2]), glm::vec3(0, 0, 1)) *
+		glm::scale(glm::mat4(1), { scale[0], scale[1], scale[2] });
+}
+
+// Top level BVH over the colliders of the pickable entities, each with its
+// own triangle BVH, to find the one under the pointer
+struct ScenePicker {
+	std::vector<Entity> entities;
+	std::vector<glm::vec3> mins, maxs; // of the entities' colliders
+	std::vector<uint32_t> slot; // by entity: its index in entities, or NONE
+	BoxBVH bvh;
+
+	void build(const SceneStore& scene) {
+		entities.clear();
+		mins.clear();
+		maxs.clear();
+		slot.assign(scene.size(), SceneStore::NONE);
+		for (Entity e = 0; e < scene.size(); e++) {
+			if ((scene.flags[e] & SceneStore::PICKABLE) && scene.collider[e] != SceneStore::NONE &&
+				!scene.colliders[scene.collider[e]].empty()) {
+				slot[e] = static_cast<uint32_t>(entities.size());
+				entities.push_back(e);
+				mins.push_back(scene.colliders[scene.collider[e]].min());
+				maxs.push_back(scene.colliders[scene.collider[e]].max());
+			}
+		}
+		bvh.build(mins, maxs, 2);
 	}
 
-	bool isClicked(Ray ray, float& distance) {
-		for (Triangle& t : body) {
-			auto intersection = t.rayIntersection(ray);
-			if (intersection) {
-				glm::vec3 temp = *intersection - ray.origin;
-				distance = glm::length(temp);
-				return distance < 4.0 && glm::dot(temp, ray.direction) > 0;
+	// After the colliders of the moved entities did: their boxes fitted
+	// again, the others kept
+	void refit(const SceneStore& scene, const std::vector<Entity>& moved) {
+		bool changed = false;
+		for (Entity e : moved) {
+			if (e < slot.size() && slot[e] != SceneStore::NONE) {
+				mins[slot[e]] = scene.colliders[scene.collider[e]].min();
+				maxs[slot[e]] = scene.colliders[scene.collider[e]].max();
+				changed = true;
 			}
 		}
+		if (changed) {
+			bvh.refit(mins, maxs);
+		}
+	}
 
-		return false;
+	// Nearest pickable entity in front of the ray closer than distance
+	// (with ray.direction normalized), which then holds its distance;
+	// SceneStore::NONE when there is none
+	Entity pick(const SceneStore& scene, const Ray& ray, float& distance) const {
+		Entity nearest = SceneStore::NONE;
+		bvh.raycast(ray, distance, [&](uint32_t first, uint32_t count, float& t) {
+			for (uint32_t i = first; i < first + count; i++) {
+				Entity e = entities[bvh.items[i]];
+				if (scene.raycast(e, ray, t)) {
+					nearest = e;
+				}
+			}
+		});
+		return nearest;
 	}
 };
 
-struct Word3D {
-	std::string textureName;
-	std::vector<float> translate;
-	std::vector<float> rotate;
-	std::vector<float> scale;
+// A hall of the museum, or the outside when it has no bounds: the outside
+// holds the camera whenever no other room does
+struct Room {
+	std::string name;
+	bool bounded = false;
+	glm::vec3 min = glm::vec3(0);
+	glm::vec3 max = glm::vec3(0);
+	std::vector<uint32_t> portals;
+
+	bool contains(glm::vec3 p) const {
+		return bounded && glm::all(glm::greaterThanEqual(p, min)) &&
+			   glm::all(glm::lessThanEqual(p, max));
+	}
+};
 
-	Model model;
-	Texture texture;
-	DescriptorSet descSet;
+// A doorway between two rooms, as the box of the opening in the wall
+struct Portal {
+	std::string roomNames[2];
+	uint32_t rooms[2];
+	glm::vec3 min;
+	glm::vec3 max;
+};
 
-	PushConstantObject pco;
-
-	void init(DescriptorSetLayout *DSL, BaseProject *bs) {
-		model.init(bs, MODEL_PATH + "museumName.obj");
-		texture.init(bs, TEXTURE_PATH + textureName);
-		descSet.init(bs, DSL, {
-			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
-			});
-
-		pco.worldMat = glm::translate(glm::mat4(1), { translate[0], translate[1], translate[2] }) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[1]), glm::vec3(0, 1, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[0]), glm::vec3(1, 0, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[2]), glm::vec3(0, 0, 1)) *
-			glm::scale(glm::mat4(1), { scale[0], scale[1], scale[2] });
-
-		pco.reflectance = 0.0f;
+void from_json(const nlohmann::json& j, Room& o) {
+	j.at("name").get_to(o.name);
+	if (j.contains("min")) {
+		std::vector<float> min = j.at("min").get<std::vector<float>>();
+		std::vector<float> max = j.at("max").get<std::vector<float>>();
+		o.min = glm::vec3(min[0], min[1], min[2]);
+		o.max = glm::vec3(max[0], max[1], max[2]);
+		o.bounded = true;
 	}
+}
 
-	void cleanup() {
-		descSet.cleanup();
-		texture.cleanup();
-		model.cleanup();
-	}
+void from_json(const nlohmann::json& j, Portal& o) {
+	std::vector<float> min = j.at("min").get<std::vector<float>>();
+	std::vector<float> max = j.at("max").get<std::vector<float>>();
+	o.roomNames[0] = j.at("rooms")[0].get<std::string>();
+	o.roomNames[1] = j.at("rooms")[1].get<std::string>();
+	o.min = glm::vec3(min[0], min[1], min[2]);
+	o.max = glm::vec3(max[0], max[1], max[2]);
+}
 
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 1, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr);
+// config/artworks.json compiled offline (--compile-scene) into a binary
+// scene, committed next to it and used in place: a header, then arrays of
+// fixed size records and the NUL terminated strings they point into.
+// Assets are resolved to ids, one per distinct file, and objects carry
+// their entity flags and world matrix, so startup reads the file and
+// walks the records; the JSON is never parsed at runtime
+const uint32_t SCENE_FILE_MAGIC = 0x5343454e; // "SCEN"
+const uint32_t SCENE_FILE_VERSION = 3;
+
+struct SceneFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t sourceHash; // of the JSON text it was compiled from
+	uint32_t assetCount;
+	uint32_t objectCount;
+	uint32_t roomCount;
+	uint32_t portalCount;
+	uint32_t stringBytes;
+	uint32_t padding;
+};
 
-		// push constant before drawing the picture
-		vkCmdPushConstants(commandBuffer, pipeline.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-			0, sizeof(PushConstantObject), &pco
-		);
+struct SceneFileAsset {
+	uint32_t type; // SceneFile::AssetType
+	uint32_t name; // path as the loaders take it, in the strings
+};
 
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
-	}
+struct SceneFileObject {
+	uint32_t flags; // SceneStore::Flags
+	float reflectance;
+	float spin; // degrees per second around the vertical, 0 when still
+	// asset ids, SceneFile::NONE when absent
+	uint32_t model;
+	uint32_t texture;
+	uint32_t collider;
+	uint32_t description;
+	float world[16];
 };
 
-struct Sofa {
-	std::string textureName;
-	std::vector<float> translate;
-	std::vector<float> rotate;
-	std::vector<float> scale;
+struct SceneFileRoom {
+	uint32_t name;
+	uint32_t bounded;
+	float min[3];
+	float max[3];
+};
 
-	std::list<Triangle> body;
+struct SceneFilePortal {
+	uint32_t rooms[2];
+	float min[3];
+	float max[3];
+};
 
-	Model model;
-	Texture texture;
-	DescriptorSet descSet;
+struct SceneFile {
+	static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
 
-	PushConstantObject pco;
+	enum AssetType : uint32_t {
+		MODEL,
+		TEXTURE,
+		COLLIDER,
+		DESCRIPTION // texture of an ArtDescription, under TEXTURE_PATH
+	};
 
-	void init(DescriptorSetLayout *DSL, BaseProject *bs) {
-		model.init(bs, MODEL_PATH + "Ottoman.obj");
-		texture.init(bs, TEXTURE_PATH + textureName);
-		descSet.init(bs, DSL, {
-			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
-			});
+	std::vector<uint8_t> data; // the whole file
 
-		pco.worldMat = glm::translate(glm::mat4(1), { translate[0], translate[1], translate[2] }) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[1]), glm::vec3(0, 1, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[0]), glm::vec3(1, 0, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[2]), glm::vec3(0, 0, 1)) *
-			glm::scale(glm::mat4(1), { scale[0], scale[1], scale[2] });
-
-		pco.reflectance = 8.0f;
-
-		loadClickArea(MODEL_PATH + "sofaBoxCollider.obj");
-	}
-
-	void loadClickArea(std::string file) {
-		tinyobj::attrib_t attrib;
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string warn, err;
-
-		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-			file.c_str())) {
-			throw std::runtime_error(warn + err);
-		}
-
-		for (const auto& shape : shapes) {
-			for (int i = 0; i < shape.mesh.indices.size(); i += 3) {
-				body.push_back(Triangle{
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i].vertex_index + 2], 1.0f),
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i + 1].vertex_index + 2], 1.0f),
-						pco.worldMat * glm::vec4(
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 0],
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 1],
-							attrib.vertices[3 * shape.mesh.indices[i + 2].vertex_index + 2], 1.0f),
-					});
-			}
+	// Loads the compiled scene, which must be there and, when its source
+	// is shipped too, compiled from it. The source is hashed, not parsed
+	void init(const std::string& source, const std::string& file) {
+		if (!load(file)) {
+			throw std::runtime_error(file + " is missing or invalid: run with --compile-scene");
 		}
+		std::ifstream in(source, std::ios::binary);
+		if (in.is_open() && sourceHash(std::string((std::istreambuf_iterator<char>(in)),
+												   std::istreambuf_iterator<char>())) != header().sourceHash) {
+			throw std::runtime_error(file + " was compiled from another " + source + ": run with --compile-scene");
+		}
+		std::cout << file << ": " << header().objectCount << " objects, "
+				  << header().assetCount << " assets" << std::endl;
 	}
 
-	void cleanup() {
-		descSet.cleanup();
-		texture.cleanup();
-		model.cleanup();
+	const SceneFileHeader& header() const {
+		return *reinterpret_cast<const SceneFileHeader*>(data.data());
 	}
 
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 1, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr);
+	const SceneFileAsset *assets() const {
+		return reinterpret_cast<const SceneFileAsset*>(data.data() + sizeof(SceneFileHeader));
+	}
 
-		// push constant before drawing the picture
-		vkCmdPushConstants(commandBuffer, pipeline.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-			0, sizeof(PushConstantObject), &pco
-		);
+	const SceneFileObject *objects() const {
+		return reinterpret_cast<const SceneFileObject*>(assets() + header().assetCount);
+	}
 
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+	const SceneFileRoom *rooms() const {
+		return reinterpret_cast<const SceneFileRoom*>(objects() + header().objectCount);
 	}
-};
 
-struct Sign {
-	std::string textureName;
-	std::vector<float> translate;
-	std::vector<float> rotate;
-	std::vector<float> scale;
+	const SceneFilePortal *portals() const {
+		return reinterpret_cast<const SceneFilePortal*>(rooms() + header().roomCount);
+	}
 
-	Model model;
-	Texture texture;
-	DescriptorSet descSet;
+	const char *string(uint32_t offset) const {
+		return reinterpret_cast<const char*>(portals() + header().portalCount) + offset;
+	}
 
-	PushConstantObject pco;
+	const char *asset(uint32_t id) const {
+		return string(assets()[id].name);
+	}
 
-	void cleanup() {
-		descSet.cleanup();
-		texture.cleanup();
-		model.cleanup();
+	bool load(const std::string& file) {
+		std::ifstream in(file, std::ios::binary | std::ios::ate);
+		if (!in.is_open()) {
+			return false;
+		}
+
+		data.resize(static_cast<size_t>(in.tellg()));
+		in.seekg(0);
+		if (data.size() < sizeof(SceneFileHeader) || !in.read(reinterpret_cast<char*>(data.data()), data.size()) ||
+			header().magic != SCENE_FILE_MAGIC || header().version != SCENE_FILE_VERSION ||
+			data.size() != size(header()) || !valid()) {
+			data.clear();
+			return false;
+		}
+		return true;
 	}
 
-	void init(DescriptorSetLayout *DSL, BaseProject *bs) {
-		model.init(bs, MODEL_PATH + "Sign.obj");
-		texture.init(bs, TEXTURE_PATH + textureName);
-		descSet.init(bs, DSL, {
-			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
-			});
+	void save(const std::string& file) const {
+		std::ofstream out(file, std::ios::binary | std::ios::trunc);
+		if (!out.is_open()) {
+			throw std::runtime_error("failed to write " + file);
+		}
+		out.write(reinterpret_cast<const char*>(data.data()), data.size());
+	}
 
-		pco.worldMat = glm::translate(glm::mat4(1), { translate[0], translate[1], translate[2] }) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[1]), glm::vec3(0, 1, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[0]), glm::vec3(1, 0, 0)) *
-			glm::rotate(glm::mat4(1), glm::radians(rotate[2]), glm::vec3(0, 0, 1)) *
-			glm::scale(glm::mat4(1), { scale[0], scale[1], scale[2] });
-		pco.reflectance = 0.0f;
-	}
-
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 1, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr);
-
-		// push constant before drawing the picture
-		vkCmdPushConstants(commandBuffer, pipeline.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-			0, sizeof(PushConstantObject), &pco
-		);
+	// FNV-1a of the source file's bytes
+	static uint64_t sourceHash(const std::string& text) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (char c : text) {
+			hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	// The scene compiler: the bytes of the compiled file of source
+	static std::vector<uint8_t> compile(const std::string& source) {
+		std::ifstream in(source, std::ios::binary);
+		if (!in.is_open()) {
+			throw std::runtime_error("failed to open " + source);
+		}
+		std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		nlohmann::json j = nlohmann::json::parse(text);
+
+		std::vector<SceneFileAsset> assets;
+		std::vector<SceneFileObject> objects;
+		std::vector<SceneFileRoom> rooms;
+		std::vector<SceneFilePortal> portals;
+		std::string strings;
+		std::unordered_map<std::string, uint32_t> ids;
+
+		auto string = [&](const std::string& s) {
+			uint32_t offset = static_cast<uint32_t>(strings.size());
+			strings.append(s);
+			strings.push_back('\0');
+			return offset;
+		};
+		auto asset = [&](AssetType type, const std::string& name) {
+			auto found = ids.find(name);
+			if (found != ids.end()) {
+				return found->second;
+			}
+			assets.push_back({ type, string(name) });
+			return ids[name] = static_cast<uint32_t>(assets.size() - 1);
+		};
+		auto object = [&](const nlohmann::json& o, uint32_t flags, float reflectance, const std::string& model) {
+			SceneFileObject object{ flags, reflectance, o.value("spin", 0.0f),
+									asset(MODEL, MODEL_PATH + model),
+									asset(TEXTURE, TEXTURE_PATH + o.at("src").get<std::string>()), NONE, NONE };
+			glm::mat4 world = worldMatrix(o);
+			memcpy(object.world, &world, sizeof(object.world));
+			objects.push_back(object);
+			return &objects.back();
+		};
+
+		object(j.at("word3D"), SceneStore::IN_ROOM, 0.0f, "museumName.obj");
+
+		// artworks open their description when clicked; statues also stop the player
+		for (const char *kind : { "pictures", "statues" }) {
+			uint32_t flags = SceneStore::INSTANCED | SceneStore::PICKABLE | SceneStore::IN_ROOM;
+			if (std::string(kind) == "statues") {
+				flags |= SceneStore::OBSTACLE;
+			}
+			for (const nlohmann::json& artwork : j.at(kind)) {
+				SceneFileObject *o = object(artwork, flags, artwork.at("reflectance").get<float>(),
+											artwork.at("model").get<std::string>());
+				o->collider = asset(COLLIDER, MODEL_PATH + artwork.at("clickArea").get<std::string>());
+				o->description = asset(DESCRIPTION, "descriptions/" + artwork.at("description").get<std::string>());
+			}
+		}
+
+		for (const nlohmann::json& sign : j.at("signs")) {
+			object(sign, SceneStore::INSTANCED | SceneStore::IN_ROOM, 0.0f, "Sign.obj");
+		}
+
+		for (const nlohmann::json& sofa : j.at("sofas")) {
+			SceneFileObject *o = object(sofa, SceneStore::INSTANCED | SceneStore::OBSTACLE | SceneStore::IN_ROOM,
+										8.0f, "Ottoman.obj");
+			o->collider = asset(COLLIDER, MODEL_PATH + "sofaBoxCollider.obj");
+		}
+
+		if (j.contains("rooms")) {
+			std::vector<Room> halls = j["rooms"].get<std::vector<Room>>();
+			for (const Room& room : halls) {
+				rooms.push_back({ string(room.name), room.bounded ? 1u : 0u,
+								  { room.min.x, room.min.y, room.min.z }, { room.max.x, room.max.y, room.max.z } });
+			}
+			for (const Portal& portal : j["portals"].get<std::vector<Portal>>()) {
+				SceneFilePortal p{ {}, { portal.min.x, portal.min.y, portal.min.z },
+								   { portal.max.x, portal.max.y, portal.max.z } };
+				for (int side = 0; side < 2; side++) {
+					auto room = std::find_if(halls.begin(), halls.end(),
+						[&](const Room& r) { return r.name == portal.roomNames[side]; });
+					if (room == halls.end()) {
+						throw std::runtime_error("portal to unknown room " + portal.roomNames[side]);
+					}
+					p.rooms[side] = static_cast<uint32_t>(room - halls.begin());
+				}
+				portals.push_back(p);
+			}
+		}
 
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+		// strings last, padded so that the size is a multiple of 4
+		strings.resize((strings.size() + 3) & ~size_t(3), '\0');
+		SceneFileHeader header{ SCENE_FILE_MAGIC, SCENE_FILE_VERSION, sourceHash(text),
+								static_cast<uint32_t>(assets.size()), static_cast<uint32_t>(objects.size()),
+								static_cast<uint32_t>(rooms.size()), static_cast<uint32_t>(portals.size()),
+								static_cast<uint32_t>(strings.size()), 0 };
+
+		std::vector<uint8_t> bytes;
+		bytes.reserve(size(header));
+		auto append = [&](const void *data, size_t size) {
+			bytes.insert(bytes.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+		};
+		append(&header, sizeof(header));
+		append(assets.data(), assets.size() * sizeof(SceneFileAsset));
+		append(objects.data(), objects.size() * sizeof(SceneFileObject));
+		append(rooms.data(), rooms.size() * sizeof(SceneFileRoom));
+		append(portals.data(), portals.size() * sizeof(SceneFilePortal));
+		append(strings.data(), strings.size());
+		return bytes;
+	}
+
+private:
+	static uint64_t size(const SceneFileHeader& header) {
+		return sizeof(SceneFileHeader) + uint64_t(header.assetCount) * sizeof(SceneFileAsset) +
+			uint64_t(header.objectCount) * sizeof(SceneFileObject) +
+			uint64_t(header.roomCount) * sizeof(SceneFileRoom) +
+			uint64_t(header.portalCount) * sizeof(SceneFilePortal) + header.stringBytes;
+	}
+
+	// Every string offset, asset id and room index of the records points
+	// inside the file, so that the accessors never read out of it
+	bool valid() const {
+		const SceneFileHeader& h = header();
+		// the last string is terminated within the table
+		if (h.stringBytes > 0 && string(0)[h.stringBytes - 1] != '\0') {
+			return false;
+		}
+		auto isString = [&](uint32_t offset) {
+			return offset < h.stringBytes;
+		};
+		auto isAsset = [&](uint32_t id, bool optional) {
+			return id < h.assetCount || (optional && id == NONE);
+		};
+
+		for (uint32_t i = 0; i < h.assetCount; i++) {
+			if (assets()[i].type > DESCRIPTION || !isString(assets()[i].name)) {
+				return false;
+			}
+		}
+		for (uint32_t i = 0; i < h.objectCount; i++) {
+			const SceneFileObject& o = objects()[i];
+			if (!isAsset(o.model, false) || !isAsset(o.texture, false) ||
+				!isAsset(o.collider, true) || !isAsset(o.description, true)) {
+				return false;
+			}
+		}
+		for (uint32_t i = 0; i < h.roomCount; i++) {
+			if (!isString(rooms()[i].name)) {
+				return false;
+			}
+		}
+		for (uint32_t i = 0; i < h.portalCount; i++) {
+			if (portals()[i].rooms[0] >= h.roomCount || portals()[i].rooms[1] >= h.roomCount) {
+				return false;
+			}
+		}
+		return true;
 	}
 };
 
-struct Environment {
-	Model model;
-	Texture texture;
-	DescriptorSet descSet;
+// Runs after FrustumCuller::cull. Starting from the camera's room, walks
+// through the portals that can be seen, narrowing at every doorway the
+// screen rectangle (in NDC) the next room is seen through; exhibits of
+// rooms that were not reached, or outside their room's rectangle, are
+// culled. Boxes that are not assigned to a room are left alone.
+struct PortalCuller {
+	std::vector<Room> rooms;
+	std::vector<Portal> portals;
+	std::vector<int32_t> objectRooms; // per FrustumCuller box, -1 if none
+	std::vector<glm::vec4> roomRects;
+	std::vector<uint8_t> reached;
+	uint32_t culled = 0;
+
+	void init(const SceneFile& scene) {
+		rooms.clear();
+		portals.clear();
+		objectRooms.clear();
+
+		for (uint32_t i = 0; i < scene.header().roomCount; i++) {
+			const SceneFileRoom& r = scene.rooms()[i];
+			Room room;
+			room.name = scene.string(r.name);
+			room.bounded = r.bounded != 0;
+			room.min = glm::vec3(r.min[0], r.min[1], r.min[2]);
+			room.max = glm::vec3(r.max[0], r.max[1], r.max[2]);
+			rooms.push_back(room);
+		}
+		for (uint32_t i = 0; i < scene.header().portalCount; i++) {
+			const SceneFilePortal& p = scene.portals()[i];
+			Portal portal;
+			for (int side = 0; side < 2; side++) {
+				portal.rooms[side] = p.rooms[side];
+				portal.roomNames[side] = rooms[p.rooms[side]].name;
+			}
+			portal.min = glm::vec3(p.min[0], p.min[1], p.min[2]);
+			portal.max = glm::vec3(p.max[0], p.max[1], p.max[2]);
+			rooms[portal.rooms[0]].portals.push_back(static_cast<uint32_t>(portals.size()));
+			rooms[portal.rooms[1]].portals.push_back(static_cast<uint32_t>(portals.size()));
+			portals.push_back(portal);
+		}
+	}
 
-	PushConstantObject pco;
+	// the room containing the centre of the box, else the outside
+	int32_t roomAt(glm::vec3 p) const {
+		int32_t outside = -1;
+		for (size_t r = 0; r < rooms.size(); r++) {
+			if (rooms[r].contains(p)) {
+				return static_cast<int32_t>(r);
+			}
+			if (!rooms[r].bounded) {
+				outside = static_cast<int32_t>(r);
+			}
+		}
+		return outside;
+	}
 
-	void cleanup() {
-		descSet.cleanup();
-		texture.cleanup();
-		model.cleanup();
+	void assign(const FrustumCuller& culler, uint32_t bounds) {
+		if (objectRooms.size() < culler.size()) {
+			objectRooms.resize(culler.size(), -1);
+		}
+		objectRooms[bounds] = roomAt(culler.centre(bounds));
 	}
 
-	void init(DescriptorSetLayout *DSL, BaseProject *bs, std::string modelString, std::string textureString, glm::mat4 position) {
-		model.init(bs, modelString);
-		texture.init(bs, textureString);
-		descSet.init(bs, DSL, {
-			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
-			});
-		pco.worldMat = position;
-		pco.reflectance = 0.0f;
-	}
-
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, Pipeline pipeline) {
-		VkBuffer vertexBuffers[] = { model.vertexBuffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			pipeline.pipelineLayout, 1, 1, &descSet.descriptorSets[currentImage],
-			0, nullptr);
-
-		// push constant before drawing the picture
-		vkCmdPushConstants(commandBuffer, pipeline.pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
-			0, sizeof(PushConstantObject), &pco
-		);
+	// Screen rectangle of a box, false when the box is outside the frustum.
+	// A box reaching behind the camera covers the whole screen.
+	static bool project(const glm::mat4& viewProj, glm::vec3 min, glm::vec3 max, glm::vec4& rect) {
+		int outside[6] = {};
+		bool behind = false;
+		glm::vec2 lo(1.0f), hi(-1.0f);
+
+		for (int k = 0; k < 8; k++) {
+			glm::vec4 c = viewProj * glm::vec4(k & 1 ? max.x : min.x,
+											   k & 2 ? max.y : min.y,
+											   k & 4 ? max.z : min.z, 1.0f);
+			outside[0] += c.x < -c.w;
+			outside[1] += c.x > c.w;
+			outside[2] += c.y < -c.w;
+			outside[3] += c.y > c.w;
+			outside[4] += c.z < 0.0f;
+			outside[5] += c.z > c.w;
+			if (c.w <= 1e-5f) {
+				behind = true;
+			} else {
+				lo = glm::min(lo, glm::vec2(c) / c.w);
+				hi = glm::max(hi, glm::vec2(c) / c.w);
+			}
+		}
+		for (int plane = 0; plane < 6; plane++) {
+			if (outside[plane] == 8) {
+				return false;
+			}
+		}
 
-		// draw the picture
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+		rect = behind ? glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f) :
+			glm::vec4(glm::max(lo, glm::vec2(-1.0f)), glm::min(hi, glm::vec2(1.0f)));
+		return true;
 	}
-};
 
-void from_json(const nlohmann::json& j, Artwork& o) {
-	j.at("src").get_to(o.textureName);
-	j.at("model").get_to(o.modelName);
-	j.at("clickArea").get_to(o.collisionModel);
-	j.at("description").get_to(o.descrTextureName);
-	j.at("type").get_to(o.type);
-	j.at("reflectance").get_to(o.reflectance);
-
-	j.at("translate").get_to(o.translate);
-	j.at("scale").get_to(o.scale);
-	j.at("rotate").get_to(o.rotate);
-}
+	void cull(FrustumCuller& culler, const glm::mat4& viewProj, glm::vec3 camPos) {
+		culled = 0;
+		int32_t start = roomAt(camPos);
+		if (start < 0) {
+			return;
+		}
 
-void from_json(const nlohmann::json& j, Sign& o) {
-	j.at("src").get_to(o.textureName);
-	j.at("translate").get_to(o.translate);
-	j.at("scale").get_to(o.scale);
-	j.at("rotate").get_to(o.rotate);
-}
+		struct Step {
+			uint32_t room;
+			glm::vec4 rect;
+			uint32_t depth;
+		};
+		reached.assign(rooms.size(), 0);
+		roomRects.assign(rooms.size(), glm::vec4(0.0f));
+		reached[start] = 1;
+		roomRects[start] = glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f);
+		std::vector<Step> steps = { { static_cast<uint32_t>(start), roomRects[start], 0 } };
+
+		while (!steps.empty()) {
+			Step step = steps.back();
+			steps.pop_back();
+			if (step.depth >= rooms.size()) {
+				continue;
+			}
 
-void from_json(const nlohmann::json& j, Sofa& o) {
-	j.at("src").get_to(o.textureName);
-	j.at("translate").get_to(o.translate);
-	j.at("scale").get_to(o.scale);
-	j.at("rotate").get_to(o.rotate);
-}
+			for (uint32_t p : rooms[step.room].portals) {
+				const Portal& portal = portals[p];
+				uint32_t next = portal.rooms[0] == step.room ? portal.rooms[1] : portal.rooms[0];
 
-void from_json(const nlohmann::json& j, Word3D& o) {
-	j.at("src").get_to(o.textureName);
-	j.at("translate").get_to(o.translate);
-	j.at("scale").get_to(o.scale);
-	j.at("rotate").get_to(o.rotate);
-}
+				glm::vec4 rect;
+				if (!project(viewProj, portal.min, portal.max, rect)) {
+					continue;
+				}
+				rect = glm::vec4(glm::max(glm::vec2(rect), glm::vec2(step.rect)),
+								 glm::min(glm::vec2(rect.z, rect.w), glm::vec2(step.rect.z, step.rect.w)));
+				if (rect.x >= rect.z || rect.y >= rect.w) {
+					continue;
+				}
+
+				// only walk on if the doorway shows more of the room than seen so far
+				glm::vec4& seen = roomRects[next];
+				if (reached[next]) {
+					if (rect.x >= seen.x && rect.y >= seen.y && rect.z <= seen.z && rect.w <= seen.w) {
+						continue;
+					}
+					seen = glm::vec4(glm::min(glm::vec2(seen), glm::vec2(rect)),
+									 glm::max(glm::vec2(seen.z, seen.w), glm::vec2(rect.z, rect.w)));
+				} else {
+					seen = rect;
+					reached[next] = 1;
+				}
+				steps.push_back({ next, rect, step.depth + 1 });
+			}
+		}
+
+		for (size_t i = 0; i < objectRooms.size(); i++) {
+			int32_t room = objectRooms[i];
+			if (room < 0 || !culler.visible[i]) {
+				continue;
+			}
+
+			glm::vec4 rect;
+			const glm::vec4& seen = roomRects[room];
+			bool visible = reached[room] &&
+				project(viewProj, glm::vec3(culler.minX[i], culler.minY[i], culler.minZ[i]),
+						glm::vec3(culler.maxX[i], culler.maxY[i], culler.maxZ[i]), rect) &&
+				rect.x < seen.z && rect.z > seen.x && rect.y < seen.w && rect.w > seen.y;
+			if (!visible) {
+				culler.visible[i] = 0;
+				culled++;
+			}
+		}
+		culler.culled += culled;
+	}
+};
 
 struct Skybox {
-	Model model;
-	Texture texture;
+	Model *model;
+	Texture *texture;
 	Pipeline pipeline;
 
 	DescriptorSet DS;
@@ -764,12 +2034,12 @@ struct Skybox {
 
 	void init(BaseProject *bp, DescriptorSetLayout *gubo_layout, DescriptorSetLayout *ubo_layout) {
 		pipeline.init(bp, "shaders/skyboxVert.spv", "shaders/skyboxFrag.spv", { gubo_layout, ubo_layout });
-		model.init(bp, MODEL_PATH + "skybox_cube.obj");
-		texture.init(bp, TEXTURE_PATH + "skybox toon.png");
+		model = bp->acquireModel(SKYBOX_MODEL);
+		texture = bp->acquireTexture(SKYBOX_TEXTURE);
 
 		DS.init(bp, ubo_layout, {
 			{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &texture}
+			{1, TEXTURE, 0, texture}
 			});
 
 		ubo.worldMatrix = glm::scale(glm::mat4(1.0f), glm::vec3(100, 100, 100));
@@ -778,35 +2048,33 @@ struct Skybox {
 
 	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage, DescriptorSet& global) {
 		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline.graphicsPipeline);
-		VkBuffer vertexBuffersSkybox[] = { model.vertexBuffer };
+		VkBuffer vertexBuffersSkybox[] = { model->vertexBuffer };
 		VkDeviceSize offsetsSkybox[] = { 0 };
 		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersSkybox, offsetsSkybox);
-		vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+		vkCmdBindIndexBuffer(commandBuffer, model->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
 		vkCmdBindDescriptorSets(commandBuffer,
 			VK_PIPELINE_BIND_POINT_GRAPHICS,
 			pipeline.pipelineLayout, 0, 1, &global.descriptorSets[currentImage],
-			0, nullptr
+			static_cast<uint32_t>(global.dynamicOffsets.size()), global.dynamicOffsets.data()
 		);
 		vkCmdBindDescriptorSets(commandBuffer,
 			VK_PIPELINE_BIND_POINT_GRAPHICS,
 			pipeline.pipelineLayout, 1, 1, &DS.descriptorSets[currentImage],
-			0, nullptr
+			static_cast<uint32_t>(DS.dynamicOffsets.size()), DS.dynamicOffsets.data()
 		);
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model.indices.size()), 1, 0, 0, 0);
+		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(model->indices.size()), 1,
+			model->firstIndex, model->vertexOffset, 0);
 	}
 
 	void cleanup() {
 		DS.cleanup();
-		model.cleanup();
-		texture.cleanup();
+		model->BP->releaseModel(model);
+		texture->BP->releaseTexture(texture);
 		pipeline.cleanup();
 	}
 
-	void updateVkMemory(VkDevice device, uint32_t currentImage) {
-		void *data;
-		vkMapMemory(device, DS.uniformBuffersMemory[0][currentImage], 0, sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, DS.uniformBuffersMemory[0][currentImage]);
+	void updateVkMemory(uint32_t currentImage) {
+		memcpy(DS.uniformBuffersMapped[0][currentImage], &ubo, sizeof(ubo));
 	}
 };
 
@@ -815,12 +2083,26 @@ struct Skybox {
 
 class MyProject : public BaseProject {
 	Player player;
-	std::list<Artwork> artworks;
-	Artwork* description = nullptr;
-	std::list<Sign> signs;
-	std::list<Sofa> sofas;
+	// every object but the skybox, the pointer and the text
+	SceneStore scene;
+	ScenePicker picker;
+	Entity hovered = SceneStore::NONE; // under the pointer, within reach
+	static constexpr float PICK_DISTANCE = 4.0f;
 	Circle pointer;
-	Word3D museumName;
+	// of the eye; the nav grid is baked for its height
+	const glm::vec3 START_POSITION = glm::vec3(-0.2f, 1.1f, 19.0f);
+
+	// exhibits given a "spin" in config/artworks.json (none by default)
+	// stand on a pedestal entity turning around the vertical through
+	// centre, by speed degrees per second; the exhibit follows it through
+	// the scene hierarchy
+	struct TurningDisplay {
+		Entity pedestal;
+		glm::vec3 centre;
+		float speed;
+	};
+	std::vector<TurningDisplay> turningDisplays;
+	std::vector<Entity> moved; // by the last SceneStore::updateTransforms
 
 
 	// time
@@ -840,11 +2122,130 @@ class MyProject : public BaseProject {
 
 	// Pipelines
 	Pipeline museumPipeline;
+	Pipeline instancedPipeline;
 	Pipeline textPipeline;
 
-	Environment Museum;
-	Environment Floor;
-	Environment Island;
+	// artworks, signs and sofas, grouped by mesh and texture
+	InstanceBatches exhibits;
+	bool instancedRendering = true;
+
+	// world space boxes of everything but the skybox and the text
+	FrustumCuller culler;
+	bool frustumCulling = true;
+	// halls and doorways from config/artworks.json, on top of the frustum
+	PortalCuller museumRooms;
+
+	// per frame averages over the last second, printed when printFrameStats is set
+	struct FrameStats {
+		uint32_t fps = 0;
+		uint32_t culled = 0;
+		uint32_t portalCulled = 0;
+		uint32_t binds = 0;
+		uint32_t bindsAvoided = 0;
+	} frameStats;
+	bool printFrameStats = false;
+	uint32_t statsFrames = 0;
+	uint32_t statsCulled = 0;
+	uint32_t statsPortalCulled = 0;
+	float statsTime = 0;
+
+	// rebuilt every frame, recorded by one or more threads
+	RenderQueue renderQueue;
+
+	// config/artworks.json compiled, loaded with the window parameters
+	SceneFile sceneFile;
+
+	Entity Museum;
+	Entity Floor;
+	Entity Island;
+
+	// the building and the island it stands on, placed by hand: created
+	// by localInit and prefetched from this same table
+	struct EnvironmentMesh {
+		Entity *entity;
+		std::string model;
+		std::string texture;
+		glm::mat4 world;
+	};
+
+	std::vector<EnvironmentMesh> environment() {
+		glm::mat4 building = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.5f, 0.0f)) *
+			glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
+			glm::scale(glm::mat4(1.0f), glm::vec3(2.2f, 1.5f, 2.2f));
+		glm::mat4 island = glm::translate(glm::mat4(1.0f), glm::vec3(2.8f, -6.47f, -1.7f)) *
+			glm::scale(glm::mat4(1.0f), glm::vec3(0.28f, 0.25f, 0.28f));
+
+		return {
+			{ &Museum, MODEL_PATH + "museumTri.obj", TEXTURE_PATH + "textureMuseum.png", building },
+			{ &Floor, MODEL_PATH + "Floor.obj", TEXTURE_PATH + "Floor.jpg", building },
+			{ &Island, MODEL_PATH + "Floating_Platform.obj", TEXTURE_PATH + "Floating_Platform.png", island }
+		};
+	}
+
+	// Objects of the compiled scene whose collider is baked into the nav
+	// grid: the obstacles that never turn
+	static bool staticObstacle(const SceneFileObject& object) {
+		return (object.flags & SceneStore::OBSTACLE) && object.spin == 0.0f &&
+			   object.collider != SceneFile::NONE;
+	}
+
+	// The files the nav grid is baked from: the compiled scene, which places
+	// the obstacles, their colliders and the environment meshes
+	std::vector<std::string> navGridSources() {
+		std::vector<std::string> files = { "config/artworks.scene" };
+		for (const EnvironmentMesh& part : environment()) {
+			files.push_back(part.model);
+		}
+		for (uint32_t i = 0; i < sceneFile.header().objectCount; i++) {
+			if (staticObstacle(sceneFile.objects()[i])) {
+				files.push_back(sceneFile.asset(sceneFile.objects()[i].collider));
+			}
+		}
+		return files;
+	}
+
+public:
+	// Bakes NAV_GRID_FILE from navGridSources: the environment meshes are the
+	// floor, the museum's walls and the static obstacles are in the way.
+	// Runs offline, with --bake-nav-grid
+	void bakeNavGrid() {
+		sceneFile.init("config/artworks.json", "config/artworks.scene");
+
+		auto place = [](const std::string& file, const glm::mat4& world, std::vector<Triangle>& triangles) {
+			MeshData mesh;
+			mesh.load(file);
+			std::vector<glm::vec3> corners = mesh.triangles();
+			for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+				triangles.push_back(Triangle{
+						world * glm::vec4(corners[i], 1.0f),
+						world * glm::vec4(corners[i + 1], 1.0f),
+						world * glm::vec4(corners[i + 2], 1.0f)
+					});
+			}
+		};
+
+		std::vector<Triangle> obstacles, floors;
+		for (const EnvironmentMesh& part : environment()) {
+			place(part.model, part.world, floors);
+			if (part.entity == &Museum) {
+				place(part.model, part.world, obstacles);
+			}
+		}
+		for (uint32_t i = 0; i < sceneFile.header().objectCount; i++) {
+			const SceneFileObject& object = sceneFile.objects()[i];
+			if (staticObstacle(object)) {
+				glm::mat4 world;
+				memcpy(&world, object.world, sizeof(world));
+				place(sceneFile.asset(object.collider), world, obstacles);
+			}
+		}
+
+		NavGrid& grid = player.navGrid;
+		grid.bake(NAV_GRID_FILE, grid.sourceHash(navGridSources(), START_POSITION.y),
+				  obstacles, floors, START_POSITION.y);
+	}
+
+private:
 
 
 	Skybox skybox;
@@ -857,19 +2258,31 @@ class MyProject : public BaseProject {
 		windowTitle = "Museum Project";
 		initialBackgroundColor = {0.0f, 0.0f, 0.0f, 1.0f};
 		
-		// Descriptor pool sizes
-		texturesInPool = 72;
-		uniformBlocksInPool = texturesInPool + 1;
-		setsInPool = texturesInPool+2;
+		sceneFile.init("config/artworks.json", "config/artworks.scene");
+
+		// set to false to benchmark rendering from host visible geometry
+		deviceLocalGeometry = true;
+
+		// exhibits index one texture array instead of binding a set each,
+		// when the device can hold every texture of the scene in it
+		std::vector<std::string> models, textures;
+		assetFiles(models, textures);
+		bindlessTextures = true;
+		bindlessTextureCount = static_cast<uint32_t>(textures.size());
+
+		// culling changes what is drawn, so the commands are recorded every frame
+		perFrameRecording = frustumCulling;
+		// parts of the frame recorded in parallel; 0 records on the main thread only
+		recordingThreads = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
 	}
 
 	// Here you load and setup all your Vulkan objects
 	void localInit() {
-		glm::mat4 temp = glm::mat4(1.0f);
+		prefetchAssets();
 
 		//----------DSL------------//
 		DSL_gubo.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
 			});
 
 		// Descriptor Layouts [what will be passed to the shaders]
@@ -878,7 +2291,7 @@ class MyProject : public BaseProject {
 			// first  element : the binding number
 			// second element : the time of element (buffer or texture)
 			// third  element : the pipeline stage where it will be used
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT},
 			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
 		});	
 
@@ -892,73 +2305,110 @@ class MyProject : public BaseProject {
 		// The last array, is a vector of pointer to the layouts of the sets that will
 		// be used in this pipeline. The first element will be set 0, and so on..
 		museumPipeline.init(this, "shaders/vert.spv", "shaders/frag.spv", {&DSL_gubo, &DSL_ubo});
+		if (instancedRendering && usesBindlessTextures()) {
+			instancedPipeline.init(this, INSTANCED_VERT_SHADER, BINDLESS_FRAG_SHADER,
+								   {&DSL_gubo, &textureArray.layout}, true);
+		} else if (instancedRendering) {
+			instancedPipeline.init(this, INSTANCED_VERT_SHADER, "shaders/frag.spv",
+								   {&DSL_gubo, &DSL_ubo}, true);
+		}
 		textPipeline.init(this, "shaders/textVert.spv", "shaders/textFrag.spv", {&DSL_ubo});
 
-		temp = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.5f, 0.0f)) *
-			glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f))*
-			glm::scale(glm::mat4(1.0f), glm::vec3(2.2f, 1.5f, 2.2f));
-
-		Museum.init(&DSL_ubo, this, MODEL_PATH + "museumTri.obj", TEXTURE_PATH + "textureMuseum.png", temp);
-		
-		temp = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.5f, 0.0f)) *
-			glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f))*
-			glm::scale(glm::mat4(1.0f), glm::vec3(2.2f, 1.5f, 2.2f));
-
-		Floor.init(&DSL_ubo, this, MODEL_PATH + "Floor.obj", TEXTURE_PATH + "Floor.jpg", temp);
-		
-		temp = glm::translate(glm::mat4(1.0f), glm::vec3(2.8f, -6.47f, -1.7f))*
-			glm::scale(glm::mat4(1.0f), glm::vec3(0.28f, 0.25f, 0.28f));
+		// set 0 of the 3D pipelines is the global set, bound with the pipeline
+		renderQueue.addPipeline(&museumPipeline, &DS_global);
+		if (instancedRendering) {
+			renderQueue.addPipeline(&instancedPipeline, &DS_global);
+		}
+		renderQueue.addPipeline(&textPipeline, nullptr);
+		// the far end of the museum, for the front to back order
+		renderQueue.depthRange = 50.0f;
 
-		Island.init(&DSL_ubo, this, MODEL_PATH + "Floating_Platform.obj", TEXTURE_PATH + "Floating_Platform.png", temp);
+		for (const EnvironmentMesh& part : environment()) {
+			*part.entity = scene.create(part.world, 0.0f);
+			scene.setMesh(*part.entity, this, &DSL_ubo, part.model, part.texture);
+		}
 
-		std::ifstream f_artworks("config/artworks.json");
-		nlohmann::json j_artworks;
-		f_artworks >> j_artworks;
-	
-		pointer.init(&DSL_ubo, this, "white.png", 0.01f);
-		museumName = j_artworks["word3D"].get<Word3D>();
-		museumName.init(&DSL_ubo, this);
-		
+		pointer.init(&DSL_ubo, this, POINTER_TEXTURE, 0.01f);
+
+		for (uint32_t i = 0; i < sceneFile.header().objectCount; i++) {
+			const SceneFileObject& object = sceneFile.objects()[i];
+			glm::mat4 world;
+			memcpy(&world, object.world, sizeof(world));
+			uint8_t flags = static_cast<uint8_t>(object.flags);
+			Entity pedestal = SceneStore::NONE;
+			if (object.spin != 0.0f && canMove(flags)) {
+				glm::vec3 centre = glm::vec3(world[3]);
+				pedestal = scene.create(glm::translate(glm::mat4(1), centre), 0.0f);
+				turningDisplays.push_back({ pedestal, centre, object.spin });
+				world = glm::translate(glm::mat4(1), -centre) * world;
+				flags |= SceneStore::MOVING;
+			}
 
-		for (auto& artwork : j_artworks["pictures"].get<std::vector<Artwork>>()) {
-			artwork.init(&DSL_ubo, this);
-			artworks.push_front(artwork);
+			Entity e = scene.create(world, object.reflectance, flags, pedestal);
+			scene.setMesh(e, this, &DSL_ubo, sceneFile.asset(object.model), sceneFile.asset(object.texture));
+			if (object.collider != SceneFile::NONE) {
+				scene.loadCollider(e, this, sceneFile.asset(object.collider));
+			}
+			if (object.description != SceneFile::NONE) {
+				scene.setDescription(e, this, &DSL_ubo, sceneFile.asset(object.description));
+			}
 		}
-		
-		for (auto& artwork : j_artworks["statues"].get<std::vector<Artwork>>()) {
-			artwork.init(&DSL_ubo, this);
-			artworks.push_front(artwork);
-			for (Triangle& t : artwork.body) {
-				player.addTriangle(t);
+
+		for (Entity e = 0; e < scene.size(); e++) {
+			if ((scene.flags[e] & SceneStore::OBSTACLE) && (scene.flags[e] & SceneStore::MOVING)) {
+				player.addMovingObstacle(&scene.colliders[scene.collider[e]]);
+			} else if (scene.flags[e] & SceneStore::OBSTACLE) {
+				for (const Triangle& t : scene.colliders[scene.collider[e]].triangles) {
+					player.addTriangle(t);
+				}
 			}
-			
 		}
 
-		for (auto& sign : j_artworks["signs"].get<std::vector<Sign>>()) {
-			sign.init(&DSL_ubo, this);
-			signs.push_front(sign);
+		const Model *museumModel = scene.mesh[Museum];
+		const glm::mat4& museumWorld = scene.transform[Museum].worldMat;
+		for (int i = 0; i < museumModel->indices.size() - 1; i += 3) {
+			player.addTriangle(Triangle{
+					museumWorld * glm::vec4(museumModel->vertices[museumModel->indices[i]].pos, 1.0f),
+					museumWorld * glm::vec4(museumModel->vertices[museumModel->indices[i + 1]].pos, 1.0f),
+					museumWorld * glm::vec4(museumModel->vertices[museumModel->indices[i + 2]].pos, 1.0f)
+				});
 		}
+		picker.build(scene);
 
-		for (auto& sofa : j_artworks["sofas"].get<std::vector<Sofa>>()) {
-			sofa.init(&DSL_ubo, this);
-			sofas.push_front(sofa);
-			for (Triangle& t : sofa.body) {
-				player.addTriangle(t);
+		for (Entity e = 0; e < scene.size(); e++) {
+			if (scene.mesh[e] != nullptr) {
+				scene.bounds[e] = culler.add(scene.mesh[e], scene.transform[e].worldMat);
 			}
 		}
 
-		for (int i = 0; i < Museum.model.indices.size() - 1; i += 3) {
-			player.addTriangle(Triangle{
-					Museum.pco.worldMat * glm::vec4(Museum.model.vertices[Museum.model.indices[i]].pos, 1.0f),
-					Museum.pco.worldMat * glm::vec4(Museum.model.vertices[Museum.model.indices[i + 1]].pos, 1.0f),
-					Museum.pco.worldMat * glm::vec4(Museum.model.vertices[Museum.model.indices[i + 2]].pos, 1.0f)
-				});
+		museumRooms.init(sceneFile);
+		if (!museumRooms.rooms.empty()) {
+			for (Entity e = 0; e < scene.size(); e++) {
+				if (scene.flags[e] & SceneStore::IN_ROOM) {
+					museumRooms.assign(culler, scene.bounds[e]);
+				}
+			}
+			std::cout << "Portal culling: " << museumRooms.rooms.size() << " rooms, "
+					  << museumRooms.portals.size() << " portals" << std::endl;
+		}
+
+		if (instancedRendering) {
+			exhibits.init(this, frustumCulling ? &culler : nullptr);
+			for (Entity e = 0; e < scene.size(); e++) {
+				if (scene.flags[e] & SceneStore::INSTANCED) {
+					scene.instance[e] = exhibits.add(scene.mesh[e], scene.texture[e], &scene.material[e],
+													 scene.transform[e], scene.bounds[e]);
+				}
+			}
+			exhibits.upload();
 		}
 
 		skybox.init(this, &DSL_gubo, &DSL_ubo);
 
 		// init the player with the right aspect ratio of the image
-		player.init(swapChainExtent.width / (float)swapChainExtent.height, { -0.2f, 1.1f, 19.0f });
+		player.init(swapChainExtent.width / (float)swapChainExtent.height, START_POSITION);
+		player.buildCollision();
+		player.navGrid.init(NAV_GRID_FILE, player.navGrid.sourceHash(navGridSources(), START_POSITION.y));
 
 		// time initialization
 		startTime = std::chrono::high_resolution_clock::now();
@@ -967,28 +2417,63 @@ class MyProject : public BaseProject {
 		glfwGetCursorPos(window, &old_xpos, &old_ypos);
 	}
 
-	// Here you destroy all the objects you created!		
-	void localCleanup() {
+	// Whether a new world matrix of an entity with these flags reaches the
+	// GPU without uploading anything: the culled instance batches copy
+	// theirs every frame, the other objects need per frame recording for
+	// their push constants
+	bool canMove(uint8_t flags) const {
+		if (instancedRendering && (flags & SceneStore::INSTANCED)) {
+			return frustumCulling;
+		}
+		return perFrameRecording;
+	}
 
-		Museum.cleanup();
-		Floor.cleanup();
-		Island.cleanup();
-		skybox.cleanup();
-		pointer.cleanup();
-		museumName.cleanup();
+	// Hands every model and texture the scene needs to the worker threads,
+	// so that decoding runs in parallel while the main thread uploads
+	void prefetchAssets() {
+		std::vector<std::string> models, textures;
+		assetFiles(models, textures);
+		prefetchModels(models);
+		prefetchTextures(textures);
+	}
 
-		for (Artwork& pic : artworks) {
-			pic.cleanup();
+	// Every model and texture file localInit loads, each once
+	void assetFiles(std::vector<std::string>& models, std::vector<std::string>& textures) {
+		models = { SKYBOX_MODEL };
+		textures = { SKYBOX_TEXTURE, TEXTURE_PATH + POINTER_TEXTURE };
+		for (const EnvironmentMesh& part : environment()) {
+			models.push_back(part.model);
+			textures.push_back(part.texture);
 		}
 
-		for (Sign& s : signs) {
-			s.cleanup();
+		for (uint32_t i = 0; i < sceneFile.header().assetCount; i++) {
+			switch (sceneFile.assets()[i].type) {
+			case SceneFile::MODEL:
+			case SceneFile::COLLIDER:
+				models.push_back(sceneFile.asset(i));
+				break;
+			case SceneFile::TEXTURE:
+				textures.push_back(sceneFile.asset(i));
+				break;
+			case SceneFile::DESCRIPTION:
+				textures.push_back(TEXTURE_PATH + sceneFile.asset(i));
+				break;
+			}
 		}
+	}
 
-		for (Sofa& s : sofas) {
-			s.cleanup();
-		}
+	// Here you destroy all the objects you created!		
+	void localCleanup() {
+
+		scene.cleanup();
+		skybox.cleanup();
+		pointer.cleanup();
 
+		if (instancedRendering) {
+			exhibits.cleanup();
+			instancedPipeline.cleanup();
+		}
+		culler.clear();
 
 		DS_global.cleanup();
 		DSL_gubo.cleanup();
@@ -997,57 +2482,66 @@ class MyProject : public BaseProject {
 		textPipeline.cleanup();
 	}
 	
-	// Here it is the creation of the command buffer:
-	// You send to the GPU all the objects you want to draw,
-	// with their buffers and textures
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
-		
-// ---------- Environment command buffer ----------
+	// Submits what the frame draws to the render queue and sorts it. Runs
+	// on the main thread before the command buffers are recorded from it.
+	void prepareCommandBuffer(int currentImage) {
+		renderQueue.clear();
+		glm::vec3 camPos = player.camera.getCamPos();
+		auto depth = [&](uint32_t bounds) {
+			return glm::distance(camPos, culler.centre(bounds));
+		};
 
-		std::ifstream f_artworks("config/artworks.json");
-		nlohmann::json j_artworks;
-		f_artworks >> j_artworks;
-		
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				museumPipeline.graphicsPipeline);
-
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			museumPipeline.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-			0, nullptr);
-
-		Museum.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
-		Island.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
-		Floor.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
-
-		museumName.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
-
-		for (Artwork& pic : artworks) {
-				pic.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
-		}
+// ---------- Environment command buffer ----------
 
-		for (Sign& s : signs) {
-			s.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
+		// the exhibits are drawn by the instance batches when they are enabled
+		uint8_t batched = instancedRendering ? SceneStore::INSTANCED : 0;
+		for (Entity e = 0; e < scene.size(); e++) {
+			if (scene.mesh[e] != nullptr && culler.visible[scene.bounds[e]] && !(scene.flags[e] & batched)) {
+				renderQueue.submit(RenderQueue::LAYER_OPAQUE, &museumPipeline, &scene.material[e], 1,
+								   *scene.mesh[e], &scene.transform[e], depth(scene.bounds[e]),
+								   scene.texture[e]);
+			}
 		}
 
-		for (Sofa& s : sofas) {
-			s.populateCommandBuffer(commandBuffer, currentImage, museumPipeline);
+		if (instancedRendering) {
+			renderQueue.submitCustom(RenderQueue::LAYER_OPAQUE, &instancedPipeline, 0.0f,
+				[this](VkCommandBuffer cb, int image) {
+					exhibits.draw(cb, image, instancedPipeline.pipelineLayout, 1);
+				});
 		}
 
-		skybox.populateCommandBuffer(commandBuffer, currentImage, DS_global);
+		renderQueue.submitCustom(RenderQueue::LAYER_SKY, nullptr, 0.0f,
+			[this](VkCommandBuffer cb, int image) {
+				skybox.populateCommandBuffer(cb, image, DS_global);
+			});
 
 		//Text
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			textPipeline.graphicsPipeline);
-
-		for (Artwork& piece : artworks) {
-			piece.description.populateCommandBuffer(commandBuffer, currentImage, textPipeline);
+		// hidden descriptions are skipped; when the commands are recorded only
+		// once they are all drawn, and the hidden ones moved off screen
+		for (uint32_t i = 0; i < scene.descriptions.size(); i++) {
+			if (scene.descriptionVisible[i] || !perFrameRecording) {
+				scene.descriptions[i].submit(renderQueue, &textPipeline);
+			}
 		}
 
-		pointer.populateCommandBuffer(commandBuffer, currentImage, textPipeline);
+		pointer.submit(renderQueue, &textPipeline);
 
-		
+		renderQueue.sort();
+	}
+
+	// Here it is the creation of the command buffer:
+	// You send to the GPU all the objects you want to draw,
+	// with their buffers and textures
+	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+		prepareCommandBuffer(currentImage);
+		renderQueue.record(commandBuffer, currentImage, 0, renderQueue.size());
+	}
 
+	// Called concurrently: each part records its own slice of the queue
+	void populateSecondaryCommandBuffer(VkCommandBuffer commandBuffer, int currentImage,
+										uint32_t part, uint32_t parts) {
+		renderQueue.record(commandBuffer, currentImage,
+						   renderQueue.size() * part / parts, renderQueue.size() * (part + 1) / parts);
 	}
 
 	// Here is where you update the uniforms.
@@ -1110,35 +2604,42 @@ class MyProject : public BaseProject {
 		
 		
 
-		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
-			float distance = -1;
-			float minDistance = std::numeric_limits<float>::infinity();
-			description = nullptr;
-
-			for (Artwork& piece : artworks) {
-				if (piece.isClicked(player.camera.getRay(), distance)) {
-					if (distance < minDistance) {
-						description = &piece;
-						minDistance = distance;
-					}
-				}
+		// ------ turning displays ------
+		for (const TurningDisplay& display : turningDisplays) {
+			scene.setLocal(display.pedestal, glm::translate(glm::mat4(1), display.centre) *
+				glm::rotate(glm::mat4(1), glm::radians(display.speed * time), glm::vec3(0, 1, 0)));
+		}
+		moved.clear();
+		scene.updateTransforms(moved);
+		for (Entity e : moved) {
+			if (scene.mesh[e] != nullptr) {
+				culler.set(scene.bounds[e], scene.mesh[e], scene.transform[e].worldMat);
+			}
+			if (scene.instance[e] != SceneStore::NONE) {
+				exhibits.setWorld(scene.instance[e], scene.transform[e].worldMat);
 			}
+		}
+		picker.refit(scene, moved);
+
+		// the pointer grows while it is over an artwork
+		Ray sight = player.camera.getRay();
+		sight.direction = glm::normalize(sight.direction);
+		float distance = PICK_DISTANCE;
+		hovered = picker.pick(scene, sight, distance);
+		pointer.ubo.worldMatrix = glm::scale(glm::mat4(1), (hovered != SceneStore::NONE ? 2.0f : 1.0f) * glm::vec3(9.0f/16.0f, 1.0f, 1.0f));
 
-			if (description != nullptr)
-				description->handleClick();
+		if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
+			if (hovered != SceneStore::NONE)
+				scene.showDescription(hovered);
 		}
 
 		if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS) {
-			for (Artwork& piece : artworks) {
-				piece.hideDescription();
-			}
+			scene.hideDescriptions();
 		}
 
 
 		// ------ copying data into buffers ------
 
-		void* data;
-
 		//Update the Camera
 		GlobalUniformBufferObject gubo{};
 		gubo.proj = player.camera.getProjectionMatrix();
@@ -1160,23 +2661,219 @@ class MyProject : public BaseProject {
 		gubo.coneInOutDecayExp = glm::vec2(0.5f, 1.5f);
 
 		// gubo
-		vkMapMemory(device, DS_global.uniformBuffersMemory[0][currentImage], 0, sizeof(gubo), 0, &data);
-		memcpy(data, &gubo, sizeof(gubo));
-		vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][currentImage]);
+		memcpy(DS_global.uniformBuffersMapped[0][currentImage], &gubo, sizeof(gubo));
+
+		// ------ frustum culling ------
+		if (frustumCulling) {
+			culler.cull(gubo.proj * gubo.view);
+			museumRooms.cull(culler, gubo.proj * gubo.view, player.camera.getCamPos());
+			if (instancedRendering) {
+				exhibits.cull(currentImage);
+			}
+			statsCulled += culler.culled;
+			statsPortalCulled += museumRooms.culled;
+		}
+
+		statsFrames++;
+		if (time - statsTime >= 1.0f) {
+			frameStats.fps = statsFrames;
+			frameStats.culled = statsCulled / statsFrames;
+			frameStats.portalCulled = statsPortalCulled / statsFrames;
+			frameStats.binds = renderQueue.binds.exchange(0) / statsFrames;
+			frameStats.bindsAvoided = renderQueue.bindsAvoided.exchange(0) / statsFrames;
+			if (printFrameStats) {
+				std::cout << "Frame stats: " << frameStats.fps << " fps, "
+						  << frameStats.culled << " of " << culler.size()
+						  << " objects culled per frame ("
+						  << frameStats.portalCulled << " by portals), "
+						  << frameStats.binds << " binds and "
+						  << frameStats.bindsAvoided
+						  << " redundant binds skipped per frame" << std::endl;
+			}
+			statsFrames = 0;
+			statsCulled = 0;
+			statsPortalCulled = 0;
+			statsTime = time;
+		}
 		
-		for (Artwork& piece : artworks) {
-			piece.description.updateUbo(currentImage, device);
+		for (ArtDescription& d : scene.descriptions) {
+			d.updateUbo(currentImage);
 		}
 
-		pointer.updateUbo(currentImage, device);
+		pointer.updateUbo(currentImage);
 
-		skybox.updateVkMemory(device, currentImage);
+		skybox.updateVkMemory(currentImage);
 	}
 };
 
+// Times the collision rays against the museum walls: the per triangle
+// plane test the player used before, the SIMD kernel over all triangles,
+// the kernel through the BVH and the player's swept collision; then
+// picking with and without the top level BVH as the number of artworks
+// grows. Run with --ray-benchmark
+void rayBenchmark() {
+	const int RAYS = 20000;
+	const float REACH = 4.0f;
+
+	MeshData mesh;
+	mesh.load(MODEL_PATH + "museumTri.obj");
+	glm::mat4 world = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.5f, 0.0f)) *
+		glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
+		glm::scale(glm::mat4(1.0f), glm::vec3(2.2f, 1.5f, 2.2f));
+
+	std::vector<Triangle> triangles;
+	std::vector<glm::vec3> corners = mesh.triangles();
+	glm::vec3 min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max());
+	for (size_t i = 0; i + 2 < corners.size(); i += 3) {
+		glm::vec3 a = world * glm::vec4(corners[i], 1.0f);
+		glm::vec3 b = world * glm::vec4(corners[i + 1], 1.0f);
+		glm::vec3 c = world * glm::vec4(corners[i + 2], 1.0f);
+		triangles.push_back(Triangle{ a, b, c });
+		min = glm::min(min, glm::min(a, glm::min(b, c)));
+		max = glm::max(max, glm::max(a, glm::max(b, c)));
+	}
+
+	TriangleSoA soa;
+	for (const Triangle& t : triangles) {
+		soa.add(t);
+	}
+	TriangleBVH bvh;
+	bvh.build(triangles);
+
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<Ray> rays;
+	for (int i = 0; i < RAYS; i++) {
+		glm::vec3 origin = min + (max - min) * glm::vec3(unit(rng), unit(rng), unit(rng));
+		float angle = unit(rng) * glm::two_pi<float>();
+		rays.push_back(Ray{ origin, glm::vec3(std::cos(angle), 0.0f, std::sin(angle)) });
+	}
+
+	auto time = [&](const char *name, auto&& cast) {
+		int hits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const Ray& ray : rays) {
+			hits += cast(ray) ? 1 : 0;
+		}
+		float us = std::chrono::duration<float, std::chrono::microseconds::period>(
+			std::chrono::steady_clock::now() - start).count();
+		std::cout << name << ": " << us / RAYS << " us per ray, " << hits << " hits\n";
+	};
+
+	std::cout << "Ray benchmark: " << triangles.size() << " triangles, " << RAYS
+		<< " rays, SIMD width " << SIMD_WIDTH << "\n";
+	time("plane test", [&](const Ray& ray) {
+		for (const Triangle& t : triangles) {
+			auto intersec = t.rayIntersection(ray);
+			if (intersec && glm::length(*intersec - ray.origin) <= REACH &&
+				glm::dot(*intersec - ray.origin, ray.direction) > 0) {
+				return true;
+			}
+		}
+		return false;
+	});
+	time("SIMD kernel", [&](const Ray& ray) {
+		float t = REACH;
+		return soa.intersect(ray, 0, soa.size(), t) >= 0;
+	});
+	time("SIMD kernel + BVH", [&](const Ray& ray) {
+		float t = REACH;
+		return bvh.raycast(ray, t) >= 0;
+	});
+
+	// the same rays as one meter moves of the player's body
+	EllipsoidCollider body;
+	body.build(triangles);
+	time("swept ellipsoid", [&](const Ray& ray) {
+		glm::vec3 end = body.move(ray.origin, ray.direction);
+		return glm::length(end - ray.origin) < 0.999f;
+	});
+
+	// picking among growing grids of copies of a statue's click area
+	MeshData statue;
+	statue.load(MODEL_PATH + "DavidCollider.obj");
+	std::vector<glm::vec3> statueCorners = statue.triangles();
+	glm::vec3 smin(std::numeric_limits<float>::max()), smax(-std::numeric_limits<float>::max());
+	for (const glm::vec3& v : statueCorners) {
+		smin = glm::min(smin, v);
+		smax = glm::max(smax, v);
+	}
+	float spacing = std::max(smax.x - smin.x, smax.z - smin.z) + 1.0f;
+	std::vector<Triangle> area;
+	for (size_t i = 0; i + 2 < statueCorners.size(); i += 3) {
+		area.push_back(Triangle{ statueCorners[i], statueCorners[i + 1], statueCorners[i + 2] });
+	}
+
+	for (int side : { 4, 16, 64 }) {
+		SceneStore gallery;
+		for (int x = 0; x < side; x++) {
+			for (int z = 0; z < side; z++) {
+				glm::vec3 offset(x * spacing, 0.0f, z * spacing);
+				Entity e = gallery.create(glm::translate(glm::mat4(1), offset), 0.0f, SceneStore::PICKABLE);
+				gallery.setCollider(e, area);
+			}
+		}
+		ScenePicker picker;
+		picker.build(gallery);
+
+		rays.clear();
+		for (int i = 0; i < RAYS; i++) {
+			glm::vec3 origin = smin + glm::vec3(unit(rng) * side * spacing, unit(rng) * (smax.y - smin.y),
+												unit(rng) * side * spacing);
+			float angle = unit(rng) * glm::two_pi<float>();
+			rays.push_back(Ray{ origin, glm::vec3(std::cos(angle), 0.0f, std::sin(angle)) });
+		}
+
+		std::cout << "Picking among " << gallery.size() << " artworks of "
+			<< area.size() << " triangles\n";
+		time("every artwork", [&](const Ray& ray) {
+			float t = REACH;
+			bool hit = false;
+			for (Entity e = 0; e < gallery.size(); e++) {
+				hit = gallery.raycast(e, ray, t) || hit;
+			}
+			return hit;
+		});
+		time("two level BVH", [&](const Ray& ray) {
+			float t = REACH;
+			return picker.pick(gallery, ray, t) != SceneStore::NONE;
+		});
+	}
+}
+
 // This is the main: probably you do not need to touch this!
-int main() {
+int main(int argc, char **argv) {
+	if (argc > 1 && std::string(argv[1]) == "--ray-benchmark") {
+		rayBenchmark();
+		return EXIT_SUCCESS;
+	}
+	// the offline scene compiler, run after editing config/artworks.json
+	if (argc > 1 && std::string(argv[1]) == "--compile-scene") {
+		try {
+			SceneFile sceneFile;
+			sceneFile.data = SceneFile::compile("config/artworks.json");
+			sceneFile.save("config/artworks.scene");
+			std::cout << "config/artworks.scene: " << sceneFile.header().objectCount << " objects, "
+					  << sceneFile.header().assetCount << " assets" << std::endl;
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
 	MyProject app;
+	// the offline nav grid baker, run after editing the scene or the models
+	// the player walks on
+	if (argc > 1 && std::string(argv[1]) == "--bake-nav-grid") {
+		try {
+			app.bakeNavGrid();
+		} catch (const std::exception& e) {
+			std::cerr << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
 
     try {
         app.run();
@@ -14,6 +14,16 @@
 #include <algorithm>
 #include <fstream>
 #include <array>
+#include <unordered_map>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <queue>
+#include <atomic>
+#include <limits>
 //FreeType
 #include <ft2build.h>
 #include FT_FREETYPE_H 
@@ -23,9 +33,23 @@
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
 
 #include <chrono>
 
+// widest SIMD instruction set the culling and ray kernels can use
+#if defined(__AVX__)
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+#if SIMD_WIDTH > 1
+#include <immintrin.h>
+#endif
+
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
@@ -35,6 +59,15 @@
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// An open upload batch is submitted early once its staging buffers grow past this
+const VkDeviceSize MAX_STAGING_BYTES = 256 * 1024 * 1024;
+
+// Upper bound of the bindless texture array, further capped by the device limits
+const uint32_t MAX_BINDLESS_TEXTURES = 1024;
+
+// Size of the device memory blocks buffers and images are sub-allocated from
+const VkDeviceSize MEMORY_BLOCK_SIZE = 64 * 1024 * 1024;
+
 // Lesson 22.0
 const std::vector<const char*> validationLayers = {
 	"VK_LAYER_KHRONOS_validation"
@@ -82,13 +115,72 @@ struct Vertex {
 
 		return attributeDescriptions;
 	}
+
+	bool operator==(const Vertex& other) const {
+		return pos == other.pos && norm == other.norm && texCoord == other.texCoord;
+	}
 };
 
+// Used by Model::loadModel to weld identical (pos, norm, uv) tuples
+namespace std {
+	template<> struct hash<Vertex> {
+		size_t operator()(Vertex const& vertex) const {
+			return ((hash<glm::vec3>()(vertex.pos) ^
+					(hash<glm::vec3>()(vertex.norm) << 1)) >> 1) ^
+					(hash<glm::vec2>()(vertex.texCoord) << 1);
+		}
+	};
+}
+
 struct PushConstantObject {
 	alignas(16) glm::mat4 worldMat;
 	alignas(16) float reflectance; //It is the Specular Power, it is equal to 0 if the model doesn't need specular reflection
 };
 
+// Per instance data of the instanced pipeline, read from a vertex buffer
+// bound at binding 1 with instance input rate
+struct InstanceData {
+	glm::mat4 worldMat;
+	float reflectance;
+	uint32_t textureIndex;
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 1;
+		bindingDescription.stride = sizeof(InstanceData);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+		return bindingDescription;
+	}
+
+	// the matrix takes one location per column
+	static std::array<VkVertexInputAttributeDescription, 6>
+						getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 6>
+						attributeDescriptions{};
+
+		for (uint32_t i = 0; i < 4; i++) {
+			attributeDescriptions[i].binding = 1;
+			attributeDescriptions[i].location = 3 + i;
+			attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+			attributeDescriptions[i].offset = offsetof(InstanceData, worldMat) +
+											  i * sizeof(glm::vec4);
+		}
+
+		attributeDescriptions[4].binding = 1;
+		attributeDescriptions[4].location = 7;
+		attributeDescriptions[4].format = VK_FORMAT_R32_SFLOAT;
+		attributeDescriptions[4].offset = offsetof(InstanceData, reflectance);
+
+		attributeDescriptions[5].binding = 1;
+		attributeDescriptions[5].location = 8;
+		attributeDescriptions[5].format = VK_FORMAT_R32_UINT;
+		attributeDescriptions[5].offset = offsetof(InstanceData, textureIndex);
+
+		return attributeDescriptions;
+	}
+};
+
 // Lesson 13
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily;
@@ -182,14 +274,163 @@ void PrintVkError( VkResult result ) {
 
 class BaseProject;
 
+// Fixed pool of worker threads for the cpu heavy part of asset loading
+// (image decoding and obj parsing). Vulkan calls stay on the main thread.
+struct ThreadPool {
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping = false;
+
+	void init(unsigned int count) {
+		for (unsigned int i = 0; i < count; i++) {
+			workers.emplace_back([this] {
+				while (true) {
+					std::function<void()> task;
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+						if (stopping && tasks.empty()) {
+							return;
+						}
+						task = std::move(tasks.front());
+						tasks.pop();
+					}
+					task();
+				}
+			});
+		}
+	}
+
+	template<typename F>
+	auto submit(F f) -> std::future<decltype(f())> {
+		auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+		std::future<decltype(f())> result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.emplace([task] { (*task)(); });
+		}
+		condition.notify_one();
+		return result;
+	}
+
+	void cleanup() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		condition.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+		workers.clear();
+	}
+
+	~ThreadPool() {
+		if (!workers.empty()) {
+			cleanup();
+		}
+	}
+};
+
+// A range of one of the MemoryAllocator blocks
+struct MemoryAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	uint32_t pool = 0;
+	uint32_t block = 0;
+};
+
+// Buffers and images are carved out of a few large vkAllocateMemory blocks
+// instead of getting a device allocation each. Every memory type has two
+// pools, one for buffers and one for optimally tiled images, so linear and
+// non linear resources never share a block and bufferImageGranularity
+// never has to be taken into account.
+struct MemoryAllocator {
+	struct Range {
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+
+	struct Block {
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		VkDeviceSize used = 0;
+		uint32_t allocations = 0;
+		std::vector<Range> freeList; // sorted by offset, neighbours merged
+		void *mapped = nullptr;
+		int mapCount = 0;
+	};
+
+	BaseProject *BP;
+	VkPhysicalDeviceMemoryProperties memProperties;
+	std::vector<std::vector<Block>> pools; // memory type * 2 + (image ? 1 : 0)
+	uint32_t deviceAllocations = 0;
+	uint32_t peakDeviceAllocations = 0;
+
+	void init(BaseProject *bp);
+	MemoryAllocation allocate(const VkMemoryRequirements& requirements,
+							  VkMemoryPropertyFlags properties, bool image);
+	void free(MemoryAllocation& allocation);
+	void *map(const MemoryAllocation& allocation);
+	void unmap(const MemoryAllocation& allocation);
+	void printStats();
+	void cleanup();
+
+private:
+	bool allocateFromBlock(Block& block, const VkMemoryRequirements& requirements,
+						   VkDeviceSize& offset);
+	uint32_t createBlock(uint32_t pool, uint32_t memoryType, VkDeviceSize size);
+};
+
+// Binary mesh cache: the result of parsing an obj file is stored in
+// MESH_CACHE_PATH and reused as long as the source size and mtime match
+const std::string MESH_CACHE_PATH = "cache/";
+const uint32_t MESH_CACHE_MAGIC = 0x4853454d; // "MESH"
+const uint32_t MESH_CACHE_VERSION = 2;
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexSize;
+	uint32_t pathLength;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+};
+
+struct MeshData {
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+
+	void load(const std::string& file);
+	// three corners per triangle, for the meshes used as colliders
+	std::vector<glm::vec3> triangles() const;
+
+private:
+	void parseObj(const std::string& file);
+	bool readCache(const std::string& cacheFile, const std::string& file,
+				   const MeshCacheHeader& expected);
+	void writeCache(const std::string& cacheFile, const std::string& file,
+					const MeshCacheHeader& header);
+};
+
 struct Model {
 	BaseProject *BP;
+	std::string file;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	MemoryAllocation indexBufferMemory;
+	// where the mesh sits when its buffers are the shared SceneGeometry ones
+	bool sharedBuffers = false;
+	uint32_t firstIndex = 0;
+	int32_t vertexOffset = 0;
 	
 	void loadModel(std::string file);
 	void createIndexBuffer();
@@ -199,15 +440,39 @@ struct Model {
 	void cleanup();
 };
 
+// Meshes loaded from file are shared: every distinct obj is parsed and
+// uploaded once, and handed out by reference count to all its users
+struct ModelRegistry {
+	struct Entry {
+		Model *model;
+		int refCount;
+	};
+
+	BaseProject *BP;
+	std::unordered_map<std::string, Entry> models;
+	std::unordered_map<std::string, std::vector<glm::vec3>> colliders;
+	std::unordered_map<std::string, std::future<MeshData>> pending;
+
+	Model *acquire(const std::string& file);
+	void release(Model *model);
+	const std::vector<glm::vec3>& collider(const std::string& file);
+	void prefetch(ThreadPool& pool, const std::vector<std::string>& files);
+	MeshData take(const std::string& file);
+	void cleanup();
+};
+
 struct Model2D {
 	BaseProject *BP;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	MemoryAllocation indexBufferMemory;
+	bool sharedBuffers = false;
+	uint32_t firstIndex = 0;
+	int32_t vertexOffset = 0;
 
 	void init(BaseProject *bp,std::vector<Vertex> verts, std::vector<uint32_t> indices);
 	void createIndexBuffer();
@@ -218,11 +483,13 @@ struct Model2D {
 
 struct Texture {
 	BaseProject *BP;
+	std::string file;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	MemoryAllocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
+	uint32_t arrayIndex = 0; // slot in BP->textureArray, with bindless textures
 	
 	void createTextureImage(std::string file);
 	void createTextureImageView();
@@ -232,6 +499,122 @@ struct Texture {
 	void cleanup();
 };
 
+// Decoded rgba pixels, waiting to be uploaded
+struct ImageData {
+	int width;
+	int height;
+	stbi_uc *pixels;
+};
+
+// Same as ModelRegistry, for images loaded from file
+struct TextureRegistry {
+	struct Entry {
+		Texture *texture;
+		int refCount;
+	};
+
+	BaseProject *BP;
+	std::unordered_map<std::string, Entry> textures;
+	std::unordered_map<std::string, std::future<ImageData>> pending;
+
+	Texture *acquire(const std::string& file);
+	void release(Texture *texture);
+	void prefetch(ThreadPool& pool, const std::vector<std::string>& files);
+	ImageData take(const std::string& file);
+	void cleanup();
+
+	static ImageData decode(const std::string& file);
+};
+
+// The sampler state that Texture::createTextureSampler can vary: textures
+// asking for the same state share a single VkSampler
+struct SamplerState {
+	VkFilter filter;
+	VkSamplerAddressMode addressMode;
+	float maxAnisotropy;
+
+	bool operator==(const SamplerState& other) const {
+		return filter == other.filter && addressMode == other.addressMode &&
+			   maxAnisotropy == other.maxAnisotropy;
+	}
+};
+
+struct SamplerStateHash {
+	size_t operator()(const SamplerState& state) const {
+		return std::hash<uint32_t>()(static_cast<uint32_t>(state.filter)) ^
+			   (std::hash<uint32_t>()(static_cast<uint32_t>(state.addressMode)) << 1) ^
+			   (std::hash<float>()(state.maxAnisotropy) << 2);
+	}
+};
+
+struct SamplerCache {
+	BaseProject *BP;
+	std::unordered_map<SamplerState, VkSampler, SamplerStateHash> samplers;
+
+	VkSampler get(const SamplerState& state);
+	void cleanup();
+};
+
+// All the static meshes packed into one vertex and one index buffer of
+// fixed capacity. Models are copied in as they are loaded and address their
+// range with firstIndex and vertexOffset; once the buffers are full, models
+// fall back to buffers of their own.
+struct SceneGeometry {
+	BaseProject *BP;
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	MemoryAllocation vertexBufferMemory;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	MemoryAllocation indexBufferMemory;
+	uint32_t vertexCapacity = 0;
+	uint32_t indexCapacity = 0;
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	uint32_t meshes = 0;
+
+	void init(BaseProject *bp, VkDeviceSize vertexBytes, VkDeviceSize indexBytes);
+	bool add(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+			 uint32_t& firstIndex, int32_t& vertexOffset);
+	void cleanup();
+};
+
+// One large host visible uniform buffer per swapchain image. Every UNIFORM
+// element of a DescriptorSet gets an aligned slice at the same offset in all
+// of them, selected by a dynamic offset when the set is bound, so that the
+// per-object uniforms of a frame are written into one contiguous block.
+// Slices are handed out by bumping head and are permanent: each object
+// rewrites its own slice every frame, and they are all given back only by
+// cleanup at shutdown, so uniformArenaSize has to hold every set at once.
+struct UniformArena {
+	BaseProject *BP;
+	std::vector<VkBuffer> buffers;
+	std::vector<MemoryAllocation> buffersMemory;
+	std::vector<char *> mapped;
+	VkDeviceSize size = 0;
+	VkDeviceSize head = 0;
+	VkDeviceSize alignment = 1;
+	uint32_t slices = 0;
+
+	void init(BaseProject *bp, VkDeviceSize size);
+	uint32_t allocate(VkDeviceSize size);
+	void cleanup();
+};
+
+// Descriptor sets come from a list of pools of fixed size: when the last
+// pool runs out another one is added, so nothing has to be sized for the
+// scene in advance. Pools are only destroyed all together by cleanup.
+struct DescriptorAllocator {
+	BaseProject *BP;
+	std::vector<VkDescriptorPool> pools;
+	uint32_t setsPerPool = 256;
+
+	void init(BaseProject *bp);
+	void allocate(const std::vector<VkDescriptorSetLayout>& layouts, VkDescriptorSet *sets);
+	void cleanup();
+
+private:
+	void addPool();
+};
+
 struct DescriptorSetLayoutBinding {
 	uint32_t binding;
 	VkDescriptorType type;
@@ -253,7 +636,7 @@ struct Pipeline {
   	VkPipelineLayout pipelineLayout;
   	
   	void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-  			  std::vector<DescriptorSetLayout *> D);
+  			  std::vector<DescriptorSetLayout *> D, bool instanced = false);
   	VkShaderModule createShaderModule(const std::vector<char>& code);
   	static std::vector<char> readFile(const std::string& filename);  	
 	void cleanup();
@@ -271,17 +654,183 @@ struct DescriptorSetElement {
 struct DescriptorSet {
 	BaseProject *BP;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+	// the uniform elements are slices of BP->uniformArena: one dynamic
+	// offset per element, to be passed to vkCmdBindDescriptorSets
+	std::vector<uint32_t> dynamicOffsets;
+	std::vector<std::vector<void *>> uniformBuffersMapped;
 	std::vector<VkDescriptorSet> descriptorSets;
-	
-	std::vector<bool> toFree;
 
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 		std::vector<DescriptorSetElement> E);
 	void cleanup();
 };
 
+// Every texture of the scene in one array of combined image samplers,
+// bound once and indexed in the shader by a per instance texture index
+// (descriptor indexing). Slots that were never written are left unbound.
+struct TextureArray {
+	BaseProject *BP;
+	DescriptorSetLayout layout;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+	uint32_t capacity = 0;
+	uint32_t count = 0;
+
+	static uint32_t capacityOf(VkPhysicalDevice physicalDevice);
+	void init(BaseProject *bp);
+	uint32_t add(Texture *texture);
+	void cleanup();
+};
+
+// World space axis aligned boxes of the scene objects, computed once at load
+// time and tested against the view frustum every frame. The boxes are kept
+// as a structure of arrays so that the kernel tests 4 (SSE) or 8 (AVX) of
+// them per plane with a single instruction each.
+struct FrustumCuller {
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+	std::vector<uint8_t> visible;
+	uint32_t culled = 0;
+
+	uint32_t add(const Model *model, const glm::mat4& worldMat);
+	void set(uint32_t i, const Model *model, const glm::mat4& worldMat);
+	void cull(const glm::mat4& viewProj);
+	size_t size() const { return visible.size(); }
+	glm::vec3 centre(uint32_t i) const {
+		return 0.5f * glm::vec3(minX[i] + maxX[i], minY[i] + maxY[i], minZ[i] + maxZ[i]);
+	}
+	void clear();
+};
+
+// Objects sharing a mesh and a texture are drawn with a single instanced
+// call: their world matrices and reflectance sit in one instance rate
+// vertex buffer, one contiguous range per batch. With bindless textures the
+// texture is part of the instance data, and only the mesh has to match.
+// With a FrustumCuller the visible instances of every batch are packed each
+// frame into a host visible buffer of the swapchain image being recorded,
+// which also holds that image's indirect commands.
+// These are the only indirect draws, and they need the instanced pipeline
+// (shaders/instancedVert.spv). The other objects are few and each one is
+// drawn by its own call from the SceneGeometry buffers.
+struct InstanceBatches {
+	struct Batch {
+		Model *model;
+		Texture *texture;
+		DescriptorSet *descSet; // the set of the first object, for the texture
+		std::vector<InstanceData> instances;
+		std::vector<uint32_t> bounds; // FrustumCuller box of each instance
+		std::vector<uint32_t> ids; // returned by add for each instance
+		uint32_t firstInstance;
+		uint32_t visibleInstances;
+	};
+
+	// consecutive batches binding the same descriptor set, issued as one
+	// vkCmdDrawIndexedIndirect
+	struct Run {
+		DescriptorSet *descSet;
+		uint32_t firstDraw;
+		uint32_t drawCount;
+	};
+
+	BaseProject *BP;
+	std::vector<Batch> batches;
+	std::vector<Run> runs;
+	std::vector<glm::uvec2> locations; // batch and index of each id
+	VkBuffer instanceBuffer = VK_NULL_HANDLE;
+	MemoryAllocation instanceBufferMemory;
+	VkBuffer indirectBuffer = VK_NULL_HANDLE;
+	MemoryAllocation indirectBufferMemory;
+	bool indirect = false;
+	bool bindless = false;
+	uint32_t instanceCount = 0;
+
+	FrustumCuller *culler = nullptr;
+	std::vector<VkBuffer> frameBuffers;
+	std::vector<MemoryAllocation> frameBuffersMemory;
+	std::vector<char *> frameMapped;
+	VkDeviceSize commandsOffset = 0;
+
+	void init(BaseProject *bp, FrustumCuller *culler = nullptr);
+	uint32_t add(Model *model, Texture *texture, DescriptorSet *descSet,
+				 const PushConstantObject& pco, uint32_t bounds = 0);
+	void upload();
+	void setWorld(uint32_t id, const glm::mat4& worldMat);
+	void cull(int currentImage);
+	void draw(VkCommandBuffer commandBuffer, int currentImage,
+			  VkPipelineLayout pipelineLayout, uint32_t set);
+	void cleanup();
+};
+
+
+// One draw of the RenderQueue: the state it needs, and the key it is sorted
+// by. Custom packets record themselves; the queue only binds their pipeline.
+struct DrawPacket {
+	uint64_t key;
+	Pipeline *pipeline;
+	DescriptorSet *global; // bound as set 0 together with the pipeline
+	DescriptorSet *material;
+	uint32_t materialSet;
+	VkBuffer vertexBuffer;
+	VkBuffer indexBuffer;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	bool hasPushConstants;
+	PushConstantObject pco;
+	std::function<void(VkCommandBuffer, int)> custom;
+};
+
+// The draws of a frame, submitted in any order and sorted by a 64 bit key:
+//   layer (4) | pipeline (8) | material (20) | mesh (16) | depth (16)
+// so that opaque geometry is grouped by state and, within the same state,
+// drawn front to back, while later layers (skybox, overlay) come last.
+// The material field is what draws share, such as their texture, and not
+// their descriptor set: sets hold per object uniforms and are all distinct.
+// Overlay packets are drawn in the order they were submitted.
+// Recording skips every bind that matches the state already bound in the
+// command buffer; the binds issued and avoided are counted across threads.
+struct RenderQueue {
+	static const uint32_t LAYER_OPAQUE = 0;
+	static const uint32_t LAYER_SKY = 1;
+	static const uint32_t LAYER_OVERLAY = 2;
+
+	std::vector<DrawPacket> packets;
+	std::vector<std::pair<uint64_t, uint32_t>> order;
+	std::unordered_map<const void *, uint32_t> pipelineIds;
+	std::unordered_map<const void *, uint32_t> materialIds;
+	std::unordered_map<const void *, uint32_t> meshIds;
+	std::vector<DescriptorSet *> globalSets; // by pipeline id, bound as set 0
+	float depthRange = 100.0f;
+
+	std::atomic<uint32_t> binds{0};
+	std::atomic<uint32_t> bindsAvoided{0};
+
+	void addPipeline(Pipeline *pipeline, DescriptorSet *global);
+	void clear();
+	void submit(uint32_t layer, Pipeline *pipeline, DescriptorSet *material, uint32_t materialSet,
+				VkBuffer vertexBuffer, VkBuffer indexBuffer, uint32_t indexCount,
+				uint32_t firstIndex, int32_t vertexOffset, const PushConstantObject *pco,
+				float depth, const void *shared = nullptr);
+	void submitCustom(uint32_t layer, Pipeline *pipeline, float depth,
+					  std::function<void(VkCommandBuffer, int)> record);
+	void sort();
+	void record(VkCommandBuffer commandBuffer, int currentImage, size_t first, size_t last);
+	size_t size() const { return order.size(); }
+
+	// for Model and Model2D
+	template<typename M>
+	void submit(uint32_t layer, Pipeline *pipeline, DescriptorSet *material, uint32_t materialSet,
+				const M& model, const PushConstantObject *pco, float depth,
+				const void *shared = nullptr) {
+		submit(layer, pipeline, material, materialSet, model.vertexBuffer, model.indexBuffer,
+			   static_cast<uint32_t>(model.indices.size()), model.firstIndex, model.vertexOffset,
+			   pco, depth, shared);
+	}
+
+private:
+	uint64_t makeKey(uint32_t layer, Pipeline *pipeline, const void *shared,
+					 const void *mesh, float depth);
+};
 
 // MAIN ! 
 class BaseProject {
@@ -292,6 +841,13 @@ class BaseProject {
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class SamplerCache;
+	friend class MemoryAllocator;
+	friend class UniformArena;
+	friend class DescriptorAllocator;
+	friend class InstanceBatches;
+	friend class SceneGeometry;
+	friend class TextureArray;
 public:
 	virtual void setWindowParameters() = 0;
     void run() {
@@ -302,14 +858,89 @@ public:
         cleanup();
     }
 
+	Model *acquireModel(const std::string& file) {
+		return modelRegistry.acquire(file);
+	}
+
+	void releaseModel(Model *model) {
+		modelRegistry.release(model);
+	}
+
+	const std::vector<glm::vec3>& loadCollider(const std::string& file) {
+		return modelRegistry.collider(file);
+	}
+
+	// set by the application in setWindowParameters, cleared when the
+	// device does not support descriptor indexing
+	bool usesBindlessTextures() const {
+		return bindlessTextures;
+	}
+
+	Texture *acquireTexture(const std::string& file) {
+		return textureRegistry.acquire(file);
+	}
+
+	void releaseTexture(Texture *texture) {
+		textureRegistry.release(texture);
+	}
+
+	// Starts decoding/parsing on the worker threads: the matching
+	// acquireModel/acquireTexture calls then only wait and upload
+	void prefetchModels(const std::vector<std::string>& files) {
+		modelRegistry.prefetch(workers, files);
+	}
+
+	void prefetchTextures(const std::vector<std::string>& files) {
+		textureRegistry.prefetch(workers, files);
+	}
+
+	// Host visible allocations share their block's mapping
+	void *mapMemory(const MemoryAllocation& allocation) {
+		return memoryAllocator.map(allocation);
+	}
+
+	void unmapMemory(const MemoryAllocation& allocation) {
+		memoryAllocator.unmap(allocation);
+	}
+
 protected:
 	uint32_t windowWidth;
 	uint32_t windowHeight;
 	std::string windowTitle;
 	VkClearColorValue initialBackgroundColor;
-	int uniformBlocksInPool;
-	int texturesInPool;
-	int setsInPool;
+	// static geometry goes to device local memory through a staging copy;
+	// when false it is rendered straight from host visible memory
+	bool deviceLocalGeometry = true;
+	// bytes of each swapchain image's uniform buffer shared by all the
+	// UNIFORM descriptor set elements
+	VkDeviceSize uniformArenaSize = 1024 * 1024;
+	// capacity of the merged static geometry buffers
+	VkDeviceSize sceneVertexBytes = 16 * 1024 * 1024;
+	VkDeviceSize sceneIndexBytes = 8 * 1024 * 1024;
+	// optional device features used by the indirect draws
+	bool multiDrawIndirect = false;
+	bool drawIndirectFirstInstance = false;
+	// all textures in one TextureArray indexed per instance, if the device
+	// can hold bindlessTextureCount of them in one array
+	bool bindlessTextures = false;
+	uint32_t bindlessTextureCount = 0;
+	// re-record the acquired image's command buffer every frame, after
+	// updateUniformBuffer, instead of once at init
+	bool perFrameRecording = false;
+	// with perFrameRecording, the frame is split into this many secondary
+	// command buffers recorded in parallel on the workers; 0 records it
+	// straight into the primary command buffer
+	uint32_t recordingThreads = 0;
+
+	ModelRegistry modelRegistry;
+	TextureRegistry textureRegistry;
+	SamplerCache samplerCache;
+	ThreadPool workers;
+	MemoryAllocator memoryAllocator;
+	UniformArena uniformArena;
+	DescriptorAllocator descriptorAllocator;
+	SceneGeometry sceneGeometry;
+	TextureArray textureArray;
 
 	// Lesson 12
     GLFWwindow* window;
@@ -323,6 +954,10 @@ protected:
     VkQueue presentQueue;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
+	// [frame in flight][part]: a pool per recording thread and frame, reset
+	// as a whole once the frame's fence has been waited on
+	std::vector<std::vector<VkCommandPool>> recordingPools;
+	std::vector<std::vector<VkCommandBuffer>> secondaryCommandBuffers;
 
     // Lesson 14
     VkSwapchainKHR swapChain;
@@ -333,8 +968,6 @@ protected:
 	
 	// Lesson 19
 	VkRenderPass renderPass;
-	
- 	VkDescriptorPool descriptorPool;
 
 	// Lesson 22
 	// L22.0 --- Debugging
@@ -342,7 +975,7 @@ protected:
 	
 	// L22.1 --- depth buffer allocation (Z-buffer)
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	MemoryAllocation depthImageMemory;
 	VkImageView depthImageView;
 
 	// L22.2 --- Frame buffers
@@ -354,6 +987,17 @@ protected:
 	std::vector<VkSemaphore> renderFinishedSemaphores;
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
+
+	// Upload batching: while a batch is open the single time commands are
+	// all recorded into one command buffer, and the staging buffers are
+	// kept alive until that command buffer has been executed
+	bool uploadBatchOpen = false;
+	VkCommandBuffer uploadCommandBuffer = VK_NULL_HANDLE;
+	VkFence uploadFence = VK_NULL_HANDLE;
+	std::vector<std::pair<VkBuffer, MemoryAllocation>> stagingBuffers;
+	VkDeviceSize stagingBytes = 0;
+	uint32_t uploadSubmissions = 0;
+	uint32_t uploadWaits = 0;
 	
 	// Lesson 12
     void initWindow() {
@@ -374,17 +1018,38 @@ protected:
 		createSurface();				// L13
 		pickPhysicalDevice();			// L14
 		createLogicalDevice();			// L14
+		memoryAllocator.init(this);
 		createSwapChain();				// L15
 		createImageViews();				// L15
 		createRenderPass();				// L19
 		createCommandPool();			// L13
 		createDepthResources();			// L22.1
 		createFramebuffers();			// L22.2
-		createDescriptorPool();			// L21
+		descriptorAllocator.init(this);	// L21
+		uniformArena.init(this, uniformArenaSize);
+		sceneGeometry.init(this, sceneVertexBytes, sceneIndexBytes);
+		if (bindlessTextures) {
+			textureArray.init(this);
+		}
 
+		workers.init(std::max(1u, std::thread::hardware_concurrency()));
+		modelRegistry.BP = this;
+		textureRegistry.BP = this;
+		samplerCache.BP = this;
+
+		beginUploadBatch();
 		localInit();
+		endUploadBatch();
+		memoryAllocator.printStats();
+		std::cout << "Uniform arena: " << uniformArena.slices << " slices, "
+				  << uniformArena.head << " of " << uniformArena.size
+				  << " bytes per image" << std::endl;
+		std::cout << "Scene geometry: " << sceneGeometry.meshes << " meshes, "
+				  << sceneGeometry.vertexCount << " vertices, "
+				  << sceneGeometry.indexCount << " indices" << std::endl;
 
 		createCommandBuffers();			// L22.5 (13)
+		createRecordingPools();
 		createSyncObjects();			// L22.3 
     }
 
@@ -396,7 +1061,8 @@ protected:
     	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     	appInfo.pEngineName = "No Engine";
     	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-		appInfo.apiVersion = VK_API_VERSION_1_0;
+		// 1.1 for vkGetPhysicalDeviceFeatures2, used to query descriptor indexing
+		appInfo.apiVersion = VK_API_VERSION_1_1;
 		
 		VkInstanceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -627,6 +1293,38 @@ protected:
 		return requiredExtensions.empty();
 	}
 
+	// The subset of descriptor indexing that TextureArray relies on
+	bool checkDescriptorIndexingSupport() {
+		uint32_t extensionCount;
+		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+					&extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+					&extensionCount, availableExtensions.data());
+
+		bool extensionFound = false;
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extension.extensionName, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) == 0) {
+				extensionFound = true;
+			}
+		}
+		if (!extensionFound) {
+			return false;
+		}
+
+		VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+		indexingFeatures.sType =
+				VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+		VkPhysicalDeviceFeatures2 features{};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features.pNext = &indexingFeatures;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+		return indexingFeatures.shaderSampledImageArrayNonUniformIndexing &&
+			   indexingFeatures.runtimeDescriptorArray &&
+			   indexingFeatures.descriptorBindingPartiallyBound;
+	}
+
 	// Lesson 14
 	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device) {
 		SwapChainSupportDetails details;
@@ -675,11 +1373,41 @@ protected:
 			queueCreateInfos.push_back(queueCreateInfo);
 		}
 		
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		multiDrawIndirect = supportedFeatures.multiDrawIndirect == VK_TRUE;
+		drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance == VK_TRUE;
+
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+		deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+		deviceFeatures.drawIndirectFirstInstance = supportedFeatures.drawIndirectFirstInstance;
+
+		std::vector<const char*> enabledExtensions = deviceExtensions;
+		VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures{};
+		indexingFeatures.sType =
+				VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+		if (bindlessTextures && !checkDescriptorIndexingSupport()) {
+			std::cout << "Descriptor indexing not supported: "
+					  << "textures are bound one set at a time" << std::endl;
+			bindlessTextures = false;
+		}
+		if (bindlessTextures && TextureArray::capacityOf(physicalDevice) < bindlessTextureCount) {
+			std::cout << "A texture array holds " << TextureArray::capacityOf(physicalDevice)
+					  << " textures, the scene has " << bindlessTextureCount
+					  << ": textures are bound one set at a time" << std::endl;
+			bindlessTextures = false;
+		}
+		if (bindlessTextures) {
+			enabledExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+			indexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+			indexingFeatures.runtimeDescriptorArray = VK_TRUE;
+			indexingFeatures.descriptorBindingPartiallyBound = VK_TRUE;
+		}
 		
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+		createInfo.pNext = bindlessTextures ? &indexingFeatures : nullptr;
 		
 		createInfo.pQueueCreateInfos = queueCreateInfos.data();
 		createInfo.queueCreateInfoCount = 
@@ -687,8 +1415,8 @@ protected:
 		
 		createInfo.pEnabledFeatures = &deviceFeatures;
 		createInfo.enabledExtensionCount =
-				static_cast<uint32_t>(deviceExtensions.size());
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+				static_cast<uint32_t>(enabledExtensions.size());
+		createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
 			createInfo.enabledLayerCount = 
 					static_cast<uint32_t>(validationLayers.size());
@@ -952,7 +1680,8 @@ protected:
 		VkCommandPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-		poolInfo.flags = 0; // Optional
+		poolInfo.flags = perFrameRecording ?
+				VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT : 0;
 		
 		VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
 		if (result != VK_SUCCESS) {
@@ -980,7 +1709,7 @@ protected:
 					 VkFormat format,
 				 	 VkImageTiling tiling, VkImageUsageFlags usage,
 				 	 VkMemoryPropertyFlags properties, VkImage& image,
-				 	 VkDeviceMemory& imageMemory) {		
+				 	 MemoryAllocation& imageMemory) {		
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1006,15 +1735,10 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
+		imageMemory = memoryAllocator.allocate(memRequirements, properties,
+											   tiling == VK_IMAGE_TILING_OPTIMAL);
 
-		vkBindImageMemory(device, image, imageMemory, 0);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 	}
 
 	// New - Lesson 23
@@ -1161,6 +1885,10 @@ protected:
 	
 	// New - Lesson 23
 	VkCommandBuffer beginSingleTimeCommands() { 
+		if (uploadBatchOpen && uploadCommandBuffer != VK_NULL_HANDLE) {
+			return uploadCommandBuffer;
+		}
+
 		VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -1176,11 +1904,19 @@ protected:
 		
 		vkBeginCommandBuffer(commandBuffer, &beginInfo);
 		
+		if (uploadBatchOpen) {
+			uploadCommandBuffer = commandBuffer;
+		}
 		return commandBuffer;
 	}
 	
 	// New - Lesson 23
 	void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+		if (uploadBatchOpen) {
+			// submitted by flushUploads
+			return;
+		}
+
 		vkEndCommandBuffer(commandBuffer);
 		
 		VkSubmitInfo submitInfo{};
@@ -1189,9 +1925,84 @@ protected:
 		submitInfo.pCommandBuffers = &commandBuffer;
 		vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
 		vkQueueWaitIdle(graphicsQueue);
+		uploadSubmissions++;
+		uploadWaits++;
 		
 		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 	}
+
+	void beginUploadBatch() {
+		VkFenceCreateInfo fenceInfo{};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+		VkResult result = vkCreateFence(device, &fenceInfo, nullptr, &uploadFence);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create upload fence!");
+		}
+
+		uploadBatchOpen = true;
+	}
+
+	void endUploadBatch() {
+		flushUploads();
+		uploadBatchOpen = false;
+
+		vkDestroyFence(device, uploadFence, nullptr);
+		uploadFence = VK_NULL_HANDLE;
+
+		std::cout << "Uploads: " << uploadSubmissions << " submissions, "
+				  << uploadWaits << " waits" << std::endl;
+	}
+
+	// Submits everything recorded in the open batch with a single fence,
+	// then frees the staging buffers it was reading from
+	void flushUploads() {
+		if (uploadCommandBuffer == VK_NULL_HANDLE) {
+			return;
+		}
+
+		vkEndCommandBuffer(uploadCommandBuffer);
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &uploadCommandBuffer;
+		VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, uploadFence);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to submit upload batch!");
+		}
+		vkWaitForFences(device, 1, &uploadFence, VK_TRUE, UINT64_MAX);
+		vkResetFences(device, 1, &uploadFence);
+		uploadSubmissions++;
+		uploadWaits++;
+
+		vkFreeCommandBuffers(device, commandPool, 1, &uploadCommandBuffer);
+		uploadCommandBuffer = VK_NULL_HANDLE;
+
+		for (auto& staging : stagingBuffers) {
+			vkDestroyBuffer(device, staging.first, nullptr);
+			memoryAllocator.free(staging.second);
+		}
+		stagingBuffers.clear();
+		stagingBytes = 0;
+	}
+
+	// Staging buffers may only go once the copies reading them have run
+	void releaseStagingBuffer(VkBuffer buffer, MemoryAllocation& memory, VkDeviceSize size) {
+		if (!uploadBatchOpen) {
+			vkDestroyBuffer(device, buffer, nullptr);
+			memoryAllocator.free(memory);
+			return;
+		}
+
+		stagingBuffers.push_back({ buffer, memory });
+		stagingBytes += size;
+		if (stagingBytes > MAX_STAGING_BYTES) {
+			flushUploads();
+		}
+	}
 	
 
 
@@ -1200,7 +2011,7 @@ protected:
 	// Lesson 21
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 					  VkMemoryPropertyFlags properties,
-					  VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+					  VkBuffer& buffer, MemoryAllocation& bufferMemory) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1217,22 +2028,86 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 		
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex =
-				findMemoryType(memRequirements.memoryTypeBits, properties);
-
-		result = vkAllocateMemory(device, &allocInfo, nullptr,
-				&bufferMemory);
-		if (result != VK_SUCCESS) {
-		 	PrintVkError(result);
-			throw std::runtime_error("failed to allocate vertex buffer memory!");
-		}
+		bufferMemory = memoryAllocator.allocate(memRequirements, properties, false);
 		
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);	
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);	
 	}
 	
+	// Creates a buffer that is written once: either device local and filled
+	// through a staging buffer, or host visible and filled directly
+	void createStaticBuffer(const void *contents, VkDeviceSize size,
+							VkBufferUsageFlags usage,
+							VkBuffer& buffer, MemoryAllocation& bufferMemory) {
+		if (!deviceLocalGeometry) {
+			createBuffer(size, usage, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+								VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+								buffer, bufferMemory);
+		} else {
+			createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+								VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+								buffer, bufferMemory);
+		}
+
+		uploadToBuffer(contents, size, buffer, bufferMemory, 0);
+	}
+
+	// Writes a range of a buffer made by createStaticBuffer (or with the same
+	// memory properties): a plain copy when it is host visible, a staging
+	// copy on the upload command buffer otherwise
+	void uploadToBuffer(const void *contents, VkDeviceSize size,
+						VkBuffer buffer, MemoryAllocation& bufferMemory,
+						VkDeviceSize offset) {
+		void* data;
+
+		if (!deviceLocalGeometry) {
+			data = memoryAllocator.map(bufferMemory);
+			memcpy(static_cast<char *>(data) + offset, contents, (size_t) size);
+			memoryAllocator.unmap(bufferMemory);
+			return;
+		}
+
+		VkBuffer stagingBuffer;
+		MemoryAllocation stagingBufferMemory;
+		createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							stagingBuffer, stagingBufferMemory);
+
+		data = memoryAllocator.map(stagingBufferMemory);
+		memcpy(data, contents, (size_t) size);
+		memoryAllocator.unmap(stagingBufferMemory);
+
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+		VkBufferCopy copyRegion{};
+		copyRegion.srcOffset = 0;
+		copyRegion.dstOffset = offset;
+		copyRegion.size = size;
+		vkCmdCopyBuffer(commandBuffer, stagingBuffer, buffer, 1, &copyRegion);
+
+		// make the copy visible to the vertex input and indirect stages
+		VkBufferMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+								VK_ACCESS_INDEX_READ_BIT |
+								VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.buffer = buffer;
+		barrier.offset = offset;
+		barrier.size = size;
+		vkCmdPipelineBarrier(commandBuffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+							 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+							 0, nullptr, 1, &barrier, 0, nullptr);
+
+		endSingleTimeCommands(commandBuffer);
+
+		releaseStagingBuffer(stagingBuffer, stagingBufferMemory, size);
+	}
+
 	// Lesson 21
 	uint32_t findMemoryType(uint32_t typeFilter,
 							VkMemoryPropertyFlags properties) {
@@ -1250,34 +2125,22 @@ protected:
 		throw std::runtime_error("failed to find suitable memory type!");
 	}
     
-    // Lesson 21
-	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
-															 swapChainImages.size());
-		// New - Lesson 23
-		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
-															 swapChainImages.size());
-		//
-
-		VkDescriptorPoolCreateInfo poolInfo{};
-		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());;
-		poolInfo.pPoolSizes = poolSizes.data();
-		poolInfo.maxSets = static_cast<uint32_t>(setsInPool * swapChainImages.size());
-		
-		VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr,
-									&descriptorPool);
-		if (result != VK_SUCCESS) {
-		 	PrintVkError(result);
-			throw std::runtime_error("failed to create descriptor pool!");
-		}
-	}
 	
 	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+	// Multithreaded recording: prepareCommandBuffer runs first on the main
+	// thread, then populateSecondaryCommandBuffer is called concurrently for
+	// every part, each with its own command buffer. The parts are executed
+	// in order, and no state is inherited between them.
+	virtual void prepareCommandBuffer(int i) {}
+
+	virtual void populateSecondaryCommandBuffer(VkCommandBuffer commandBuffer, int i,
+												uint32_t part, uint32_t parts) {
+		if (part == 0) {
+			populateCommandBuffer(commandBuffer, i);
+		}
+	}
+
 	// Lesson 22.5 (and 13)
     void createCommandBuffers() {
     	// Lesson 13
@@ -1299,57 +2162,153 @@ protected:
 		// Lesson 22.5 --- Draw calls
 		// This is where the commands that actually draw something on screen are!
 		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
-
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-						VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
-			}
-			
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass; 
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = {0, 0};
-			renderPassInfo.renderArea.extent = swapChainExtent;
-	
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = {1.0f, 0};
-	
-			renderPassInfo.clearValueCount =
-							static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
-			
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-					VK_SUBPASS_CONTENTS_INLINE);			
-	
+			recordCommandBuffer(static_cast<uint32_t>(i), false);
+		}
+	}
 
-			populateCommandBuffer(commandBuffers[i], i);
-			
+	void createRecordingPools() {
+		if (!perFrameRecording || recordingThreads == 0) {
+			return;
+		}
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+		QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+		recordingPools.resize(MAX_FRAMES_IN_FLIGHT);
+		secondaryCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+		for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+			recordingPools[frame].resize(recordingThreads);
+			secondaryCommandBuffers[frame].resize(recordingThreads);
+			for (uint32_t part = 0; part < recordingThreads; part++) {
+				VkCommandPoolCreateInfo poolInfo{};
+				poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+				poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+				poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+				VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr,
+						&recordingPools[frame][part]);
+				if (result != VK_SUCCESS) {
+				 	PrintVkError(result);
+					throw std::runtime_error("failed to create recording command pool!");
+				}
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = recordingPools[frame][part];
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+				allocInfo.commandBufferCount = 1;
+
+				result = vkAllocateCommandBuffers(device, &allocInfo,
+						&secondaryCommandBuffers[frame][part]);
+				if (result != VK_SUCCESS) {
+				 	PrintVkError(result);
+					throw std::runtime_error("failed to allocate secondary command buffers!");
+				}
 			}
 		}
+		std::cout << "Recording: " << recordingThreads << " secondary command buffers per frame"
+				  << std::endl;
 	}
-    
-    // Lesson 22.5
-    void createSyncObjects() {
-    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
-    	    	
-    	VkSemaphoreCreateInfo semaphoreInfo{};
-		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-		
-		VkFenceCreateInfo fenceInfo{};
+
+	// Records one part of the frame into the secondary command buffer of
+	// the given frame in flight, from that part's own pool
+	void recordSecondaryCommandBuffer(uint32_t i, size_t frame, uint32_t part) {
+		vkResetCommandPool(device, recordingPools[frame][part], 0);
+
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritanceInfo.renderPass = renderPass;
+		inheritanceInfo.subpass = 0;
+		inheritanceInfo.framebuffer = swapChainFramebuffers[i];
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+						  VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+		VkCommandBuffer commandBuffer = secondaryCommandBuffers[frame][part];
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording secondary command buffer!");
+		}
+
+		populateSecondaryCommandBuffer(commandBuffer, i, part, recordingThreads);
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record secondary command buffer!");
+		}
+	}
+
+	void recordCommandBuffer(uint32_t i, bool secondary) {
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = perFrameRecording ?
+				VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
+		beginInfo.pInheritanceInfo = nullptr; // Optional
+
+		if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
+					VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass; 
+		renderPassInfo.framebuffer = swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = swapChainExtent;
+
+		std::array<VkClearValue, 2> clearValues{};
+		clearValues[0].color = initialBackgroundColor;
+		clearValues[1].depthStencil = {1.0f, 0};
+
+		renderPassInfo.clearValueCount =
+						static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
+		
+		vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
+				secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+							VK_SUBPASS_CONTENTS_INLINE);			
+
+		if (secondary) {
+			// the workers record the other parts while this thread does part 0
+			prepareCommandBuffer(i);
+			size_t frame = currentFrame;
+			std::vector<std::future<void>> parts;
+			for (uint32_t part = 1; part < recordingThreads; part++) {
+				parts.push_back(workers.submit([this, i, frame, part] {
+					recordSecondaryCommandBuffer(i, frame, part);
+				}));
+			}
+			recordSecondaryCommandBuffer(i, frame, 0);
+			for (std::future<void>& part : parts) {
+				part.get();
+			}
+
+			vkCmdExecuteCommands(commandBuffers[i], recordingThreads,
+					secondaryCommandBuffers[frame].data());
+		} else {
+			populateCommandBuffer(commandBuffers[i], i);
+		}
+		
+
+		vkCmdEndRenderPass(commandBuffers[i]);
+
+		if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
+    
+    // Lesson 22.5
+    void createSyncObjects() {
+    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+    	    	
+    	VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		
+		VkFenceCreateInfo fenceInfo{};
 		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 		
@@ -1398,6 +2357,13 @@ protected:
 		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 		
 		updateUniformBuffer(imageIndex);
+
+		// the fence above guarantees the previous submission of this
+		// image's command buffer has completed
+		if (perFrameRecording) {
+			vkResetCommandBuffer(commandBuffers[imageIndex], 0);
+			recordCommandBuffer(imageIndex, recordingThreads > 0);
+		}
 		
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
@@ -1445,7 +2411,7 @@ protected:
     void cleanup() {
 		vkDestroyImageView(device, depthImageView, nullptr);
 		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		memoryAllocator.free(depthImageMemory);
 
 		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
 			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
@@ -1462,10 +2428,20 @@ protected:
 		
 		vkDestroySwapchainKHR(device, swapChain, nullptr);
 		
-		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		descriptorAllocator.cleanup();
     	
     	
 		localCleanup();
+		modelRegistry.cleanup();
+		textureRegistry.cleanup();
+		samplerCache.cleanup();
+		workers.cleanup();
+		uniformArena.cleanup();
+		sceneGeometry.cleanup();
+		if (bindlessTextures) {
+			textureArray.cleanup();
+		}
+		memoryAllocator.cleanup();
     	
     	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
 			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
@@ -1474,6 +2450,13 @@ protected:
     	}
     	
     	vkDestroyCommandPool(device, commandPool, nullptr);
+		for (std::vector<VkCommandPool>& pools : recordingPools) {
+			for (VkCommandPool pool : pools) {
+				vkDestroyCommandPool(device, pool, nullptr);
+			}
+		}
+		recordingPools.clear();
+		secondaryCommandBuffers.clear();
     	
  		vkDestroyDevice(device, nullptr);
 		
@@ -1490,7 +2473,34 @@ protected:
 
 
 
-void Model::loadModel(std::string file) {
+void MeshData::load(const std::string& file) {
+	std::error_code ec;
+	MeshCacheHeader header{};
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.vertexSize = sizeof(Vertex);
+	header.pathLength = static_cast<uint32_t>(file.size());
+	header.sourceSize = std::filesystem::file_size(file, ec);
+	header.sourceTime = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+
+	std::string cacheFile = file;
+	std::replace(cacheFile.begin(), cacheFile.end(), '/', '_');
+	cacheFile = MESH_CACHE_PATH + cacheFile + ".bin";
+
+	if (!ec && readCache(cacheFile, file, header)) {
+		std::cout << file << ": " << indices.size() << " -> " << vertices.size()
+				  << " vertices (cached)" << std::endl;
+		return;
+	}
+
+	parseObj(file);
+
+	if (!ec) {
+		writeCache(cacheFile, file, header);
+	}
+}
+
+void MeshData::parseObj(const std::string& file) {
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
@@ -1501,6 +2511,11 @@ void Model::loadModel(std::string file) {
 		throw std::runtime_error(warn + err);
 	}
 	
+	// every face corner is a separate entry in the obj file: identical
+	// corners are welded together so that the index buffer actually indexes
+	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+	size_t corners = 0;
+
 	for (const auto& shape : shapes) {
 		for (const auto& index : shape.mesh.indices) {
 			Vertex vertex{};
@@ -1511,66 +2526,231 @@ void Model::loadModel(std::string file) {
 				attrib.vertices[3 * index.vertex_index + 2]
 			};
 			
-			vertex.texCoord = {
-				attrib.texcoords[2 * index.texcoord_index + 0],
-				1 - attrib.texcoords[2 * index.texcoord_index + 1] 
-			};
+			// colliders are exported without uvs and normals
+			if (index.texcoord_index >= 0) {
+				vertex.texCoord = {
+					attrib.texcoords[2 * index.texcoord_index + 0],
+					1 - attrib.texcoords[2 * index.texcoord_index + 1] 
+				};
+			}
 
-			vertex.norm = {
-				attrib.normals[3 * index.normal_index + 0],
-				attrib.normals[3 * index.normal_index + 1],
-				attrib.normals[3 * index.normal_index + 2]
-			};
+			if (index.normal_index >= 0) {
+				vertex.norm = {
+					attrib.normals[3 * index.normal_index + 0],
+					attrib.normals[3 * index.normal_index + 1],
+					attrib.normals[3 * index.normal_index + 2]
+				};
+			}
 			
-			vertices.push_back(vertex);
-			indices.push_back(vertices.size()-1);
+			auto found = uniqueVertices.find(vertex);
+			if (found == uniqueVertices.end()) {
+				found = uniqueVertices.emplace(vertex, static_cast<uint32_t>(vertices.size())).first;
+				vertices.push_back(vertex);
+			}
+			indices.push_back(found->second);
+			corners++;
 		}
 	}
 	
-	
+	std::cout << file << ": " << corners << " -> " << vertices.size() << " vertices" << std::endl;
+}
+
+bool MeshData::readCache(const std::string& cacheFile, const std::string& file,
+						 const MeshCacheHeader& expected) {
+	std::ifstream in(cacheFile, std::ios::ate | std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+
+	// the whole file is read at once and then split into the arrays
+	size_t fileSize = (size_t) in.tellg();
+	if (fileSize < sizeof(MeshCacheHeader)) {
+		return false;
+	}
+	std::vector<char> buffer(fileSize);
+	in.seekg(0);
+	in.read(buffer.data(), fileSize);
+	in.close();
+
+	MeshCacheHeader header;
+	memcpy(&header, buffer.data(), sizeof(header));
+	if (header.magic != expected.magic || header.version != expected.version ||
+		header.vertexSize != expected.vertexSize || header.pathLength != expected.pathLength ||
+		header.sourceSize != expected.sourceSize || header.sourceTime != expected.sourceTime) {
+		return false;
+	}
+
+	size_t offset = sizeof(header);
+	size_t verticesSize = header.vertexCount * sizeof(Vertex);
+	size_t indicesSize = header.indexCount * sizeof(uint32_t);
+	if (fileSize != offset + header.pathLength + verticesSize + indicesSize ||
+		file.compare(0, file.size(), buffer.data() + offset, header.pathLength) != 0) {
+		return false;
+	}
+	offset += header.pathLength;
+
+	vertices.resize(header.vertexCount);
+	memcpy(vertices.data(), buffer.data() + offset, verticesSize);
+	offset += verticesSize;
+
+	indices.resize(header.indexCount);
+	memcpy(indices.data(), buffer.data() + offset, indicesSize);
+
+	return true;
+}
+
+void MeshData::writeCache(const std::string& cacheFile, const std::string& file,
+						  const MeshCacheHeader& expected) {
+	std::error_code ec;
+	std::filesystem::create_directories(MESH_CACHE_PATH, ec);
+
+	std::ofstream out(cacheFile, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		std::cout << "cannot write mesh cache " << cacheFile << std::endl;
+		return;
+	}
+
+	MeshCacheHeader header = expected;
+	header.vertexCount = vertices.size();
+	header.indexCount = indices.size();
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(file.data(), file.size());
+	out.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(Vertex));
+	out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(uint32_t));
+}
+
+// welding kept every corner's position, so the indices give them back
+std::vector<glm::vec3> MeshData::triangles() const {
+	std::vector<glm::vec3> corners;
+	corners.reserve(indices.size());
+	for (uint32_t index : indices) {
+		corners.push_back(vertices[index].pos);
+	}
+	return corners;
+}
+
+void Model::loadModel(std::string file) {
+	MeshData mesh = BP->modelRegistry.take(file);
+
+	vertices = std::move(mesh.vertices);
+	indices = std::move(mesh.indices);
 }
 
 // Lesson 21
 void Model::createVertexBuffer() {
 	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-	
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-						vertexBuffer, vertexBufferMemory);
 
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);			
+	BP->createStaticBuffer(vertices.data(), bufferSize,
+						   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+						   vertexBuffer, vertexBufferMemory);
 }
 
 void Model::createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-							 indexBuffer, indexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+	BP->createStaticBuffer(indices.data(), bufferSize,
+						   VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+						   indexBuffer, indexBufferMemory);
 }
 
 void Model::init(BaseProject *bp, std::string file) {
 	BP = bp;
+	this->file = file;
 	loadModel(file);
-	createVertexBuffer();
-	createIndexBuffer();
+
+	sharedBuffers = BP->sceneGeometry.add(vertices, indices, firstIndex, vertexOffset);
+	if (sharedBuffers) {
+		vertexBuffer = BP->sceneGeometry.vertexBuffer;
+		indexBuffer = BP->sceneGeometry.indexBuffer;
+	} else {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
 }
 
 void Model::cleanup() {
+	if (sharedBuffers) {
+		return;
+	}
    	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-   	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+   	BP->memoryAllocator.free(indexBufferMemory);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-   	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+   	BP->memoryAllocator.free(vertexBufferMemory);
+}
+
+Model *ModelRegistry::acquire(const std::string& file) {
+	auto found = models.find(file);
+	if (found != models.end()) {
+		found->second.refCount++;
+		return found->second.model;
+	}
+
+	Model *model = new Model();
+	model->init(BP, file);
+	models[file] = { model, 1 };
+	return model;
+}
+
+void ModelRegistry::release(Model *model) {
+	auto found = models.find(model->file);
+	if (found == models.end() || --found->second.refCount > 0) {
+		return;
+	}
+
+	found->second.model->cleanup();
+	delete found->second.model;
+	models.erase(found);
+}
+
+const std::vector<glm::vec3>& ModelRegistry::collider(const std::string& file) {
+	auto found = colliders.find(file);
+	if (found != colliders.end()) {
+		return found->second;
+	}
+
+	return colliders[file] = take(file).triangles();
+}
+
+void ModelRegistry::prefetch(ThreadPool& pool, const std::vector<std::string>& files) {
+	for (const std::string& file : files) {
+		if (models.count(file) || colliders.count(file) || pending.count(file)) {
+			continue;
+		}
+		pending[file] = pool.submit([file] {
+			MeshData mesh;
+			mesh.load(file);
+			return mesh;
+		});
+	}
+}
+
+MeshData ModelRegistry::take(const std::string& file) {
+	auto found = pending.find(file);
+	if (found != pending.end()) {
+		MeshData mesh = found->second.get();
+		pending.erase(found);
+		return mesh;
+	}
+
+	MeshData mesh;
+	mesh.load(file);
+	return mesh;
+}
+
+void ModelRegistry::cleanup() {
+	for (auto& entry : models) {
+		entry.second.model->cleanup();
+		delete entry.second.model;
+	}
+	models.clear();
+	colliders.clear();
+
+	// anything prefetched but never used still has to finish
+	for (auto& entry : pending) {
+		entry.second.wait();
+	}
+	pending.clear();
 }
 
 void Model2D::init(BaseProject *bp, std::vector<Vertex> verts, std::vector<uint32_t> indices) {
@@ -1578,61 +2758,55 @@ void Model2D::init(BaseProject *bp, std::vector<Vertex> verts, std::vector<uint3
 	this->indices = indices;
 	this->BP = bp;
 
-	createVertexBuffer();
-	createIndexBuffer();
+	sharedBuffers = BP->sceneGeometry.add(vertices, indices, firstIndex, vertexOffset);
+	if (sharedBuffers) {
+		vertexBuffer = BP->sceneGeometry.vertexBuffer;
+		indexBuffer = BP->sceneGeometry.indexBuffer;
+	} else {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
 }
 
 void Model2D::createVertexBuffer() {
 	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		vertexBuffer, vertexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);
+	BP->createStaticBuffer(vertices.data(), bufferSize,
+						   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+						   vertexBuffer, vertexBufferMemory);
 }
 
 void Model2D::createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		indexBuffer, indexBufferMemory);
-
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+	BP->createStaticBuffer(indices.data(), bufferSize,
+						   VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+						   indexBuffer, indexBufferMemory);
 }
 
 void Model2D::cleanup() {
+	if (sharedBuffers) {
+		return;
+	}
 	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+	BP->memoryAllocator.free(indexBufferMemory);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	BP->memoryAllocator.free(vertexBufferMemory);
 }
 
 
 
 void Texture::createTextureImage(std::string file) {
-	int texWidth, texHeight, texChannels;
-	stbi_uc* pixels = stbi_load(file.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-	
-	if (!pixels) {
-		std::cout << stbi_failure_reason() << std::endl;
-		throw std::runtime_error("failed to load texture image!");
-	}
+	ImageData image = BP->textureRegistry.take(file);
+	int texWidth = image.width;
+	int texHeight = image.height;
+	stbi_uc* pixels = image.pixels;
 
 	VkDeviceSize imageSize = texWidth * texHeight * 4;
 	mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;
 	
 	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	MemoryAllocation stagingBufferMemory;
 
 	BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -1640,9 +2814,9 @@ void Texture::createTextureImage(std::string file) {
 	  						stagingBuffer, stagingBufferMemory);
 
 	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
+	data = BP->memoryAllocator.map(stagingBufferMemory);
 	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(BP->device, stagingBufferMemory);
+	BP->memoryAllocator.unmap(stagingBufferMemory);
 	
 	stbi_image_free(pixels);
 
@@ -1661,8 +2835,7 @@ void Texture::createTextureImage(std::string file) {
 	BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
 					texWidth, texHeight, mipLevels);
 
-	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+	BP->releaseStagingBuffer(stagingBuffer, stagingBufferMemory, imageSize);
 }
 
 void Texture::createTextureImageView() {
@@ -1673,19 +2846,123 @@ void Texture::createTextureImageView() {
 }
 	
 void Texture::createTextureSampler() {
+	// the lod range is left open so that one sampler fits every mip chain
+	textureSampler = BP->samplerCache.get({
+		VK_FILTER_LINEAR,
+		VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT,
+		16.0f
+	});
+}
+
+void Texture::init(BaseProject *bp, std::string file) {
+	BP = bp;
+	this->file = file;
+	createTextureImage(file);
+	createTextureImageView();
+	createTextureSampler();
+	if (BP->bindlessTextures) {
+		arrayIndex = BP->textureArray.add(this);
+	}
+}
+
+void Texture::cleanup() {
+	// the sampler belongs to BP->samplerCache
+   	vkDestroyImageView(BP->device, textureImageView, nullptr);
+	vkDestroyImage(BP->device, textureImage, nullptr);
+	BP->memoryAllocator.free(textureImageMemory);
+}
+
+Texture *TextureRegistry::acquire(const std::string& file) {
+	auto found = textures.find(file);
+	if (found != textures.end()) {
+		found->second.refCount++;
+		return found->second.texture;
+	}
+
+	Texture *texture = new Texture();
+	texture->init(BP, file);
+	textures[file] = { texture, 1 };
+	return texture;
+}
+
+void TextureRegistry::release(Texture *texture) {
+	auto found = textures.find(texture->file);
+	if (found == textures.end() || --found->second.refCount > 0) {
+		return;
+	}
+
+	found->second.texture->cleanup();
+	delete found->second.texture;
+	textures.erase(found);
+}
+
+void TextureRegistry::prefetch(ThreadPool& pool, const std::vector<std::string>& files) {
+	for (const std::string& file : files) {
+		if (textures.count(file) || pending.count(file)) {
+			continue;
+		}
+		pending[file] = pool.submit([file] {
+			return decode(file);
+		});
+	}
+}
+
+ImageData TextureRegistry::take(const std::string& file) {
+	auto found = pending.find(file);
+	if (found != pending.end()) {
+		ImageData image = found->second.get();
+		pending.erase(found);
+		return image;
+	}
+
+	return decode(file);
+}
+
+ImageData TextureRegistry::decode(const std::string& file) {
+	ImageData image;
+	int texChannels;
+	image.pixels = stbi_load(file.c_str(), &image.width, &image.height, &texChannels, STBI_rgb_alpha);
+	
+	if (!image.pixels) {
+		std::cout << file << ": " << stbi_failure_reason() << std::endl;
+		throw std::runtime_error("failed to load texture image!");
+	}
+
+	return image;
+}
+
+void TextureRegistry::cleanup() {
+	for (auto& entry : textures) {
+		entry.second.texture->cleanup();
+		delete entry.second.texture;
+	}
+	textures.clear();
+
+	// anything prefetched but never used still owns its pixels
+	for (auto& entry : pending) {
+		try {
+			stbi_image_free(entry.second.get().pixels);
+		} catch (const std::exception&) {
+		}
+	}
+	pending.clear();
+}
+
+VkSampler SamplerCache::get(const SamplerState& state) {
+	auto found = samplers.find(state);
+	if (found != samplers.end()) {
+		return found->second;
+	}
+
 	VkSamplerCreateInfo samplerInfo{};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-	samplerInfo.magFilter = VK_FILTER_LINEAR;
-	samplerInfo.minFilter = VK_FILTER_LINEAR;
-	//samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	//samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	//samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.anisotropyEnable = VK_TRUE;
-	samplerInfo.maxAnisotropy = 16;
+	samplerInfo.magFilter = state.filter;
+	samplerInfo.minFilter = state.filter;
+	samplerInfo.addressModeU = state.addressMode;
+	samplerInfo.addressModeV = state.addressMode;
+	samplerInfo.addressModeW = state.addressMode;
+	samplerInfo.anisotropyEnable = state.maxAnisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+	samplerInfo.maxAnisotropy = state.maxAnisotropy;
 	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
 	samplerInfo.unnormalizedCoordinates = VK_FALSE;
 	samplerInfo.compareEnable = VK_FALSE;
@@ -1693,32 +2970,416 @@ void Texture::createTextureSampler() {
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 	samplerInfo.mipLodBias = 0.0f;
 	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = static_cast<float>(mipLevels);
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
 	
+	VkSampler sampler;
 	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
-									  &textureSampler);
+									  &sampler);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 	 	throw std::runtime_error("failed to create texture sampler!");
 	}
+
+	samplers[state] = sampler;
+	return sampler;
 }
 
-void Texture::init(BaseProject *bp, std::string file) {
+void SamplerCache::cleanup() {
+	for (auto& entry : samplers) {
+		vkDestroySampler(BP->device, entry.second, nullptr);
+	}
+	samplers.clear();
+}
+
+void MemoryAllocator::init(BaseProject *bp) {
 	BP = bp;
-	createTextureImage(file);
-	createTextureImageView();
-	createTextureSampler();
+	vkGetPhysicalDeviceMemoryProperties(BP->physicalDevice, &memProperties);
+	pools.resize(memProperties.memoryTypeCount * 2);
 }
 
-void Texture::cleanup() {
-   	vkDestroySampler(BP->device, textureSampler, nullptr);
-   	vkDestroyImageView(BP->device, textureImageView, nullptr);
-	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+MemoryAllocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+										   VkMemoryPropertyFlags properties, bool image) {
+	uint32_t memoryType = BP->findMemoryType(requirements.memoryTypeBits, properties);
+	uint32_t pool = memoryType * 2 + (image ? 1 : 0);
+
+	MemoryAllocation allocation;
+	allocation.size = requirements.size;
+	allocation.pool = pool;
+
+	// first fit over the blocks already reserved for this pool
+	for (uint32_t i = 0; i < pools[pool].size(); i++) {
+		Block& block = pools[pool][i];
+		if (block.memory != VK_NULL_HANDLE &&
+			allocateFromBlock(block, requirements, allocation.offset)) {
+			allocation.memory = block.memory;
+			allocation.block = i;
+			return allocation;
+		}
+	}
+
+	// resources larger than a block get a block of their own
+	uint32_t i = createBlock(pool, memoryType,
+							 std::max(MEMORY_BLOCK_SIZE, requirements.size));
+	Block& block = pools[pool][i];
+	allocateFromBlock(block, requirements, allocation.offset);
+	allocation.memory = block.memory;
+	allocation.block = i;
+	return allocation;
+}
+
+bool MemoryAllocator::allocateFromBlock(Block& block, const VkMemoryRequirements& requirements,
+										VkDeviceSize& offset) {
+	VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+
+	for (size_t i = 0; i < block.freeList.size(); i++) {
+		Range range = block.freeList[i];
+		VkDeviceSize start = (range.offset + alignment - 1) / alignment * alignment;
+		VkDeviceSize end = start + requirements.size;
+		if (end > range.offset + range.size) {
+			continue;
+		}
+
+		// the alignment padding before the allocation stays on the free list
+		// and merges back once its neighbour is freed
+		std::vector<Range> remaining;
+		if (start > range.offset) {
+			remaining.push_back({ range.offset, start - range.offset });
+		}
+		if (end < range.offset + range.size) {
+			remaining.push_back({ end, range.offset + range.size - end });
+		}
+		block.freeList.erase(block.freeList.begin() + i);
+		block.freeList.insert(block.freeList.begin() + i, remaining.begin(), remaining.end());
+
+		block.used += requirements.size;
+		block.allocations++;
+		offset = start;
+		return true;
+	}
+
+	return false;
+}
+
+uint32_t MemoryAllocator::createBlock(uint32_t pool, uint32_t memoryType, VkDeviceSize size) {
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	VkDeviceMemory memory;
+	VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr, &memory);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to allocate device memory block!");
+	}
+	deviceAllocations++;
+	peakDeviceAllocations = std::max(peakDeviceAllocations, deviceAllocations);
+
+	Block block;
+	block.memory = memory;
+	block.size = size;
+	block.freeList.push_back({ 0, size });
+
+	// reuse the slot of a block that was given back, so that the block
+	// index stored in the live allocations stays valid
+	std::vector<Block>& blocks = pools[pool];
+	for (uint32_t i = 0; i < blocks.size(); i++) {
+		if (blocks[i].memory == VK_NULL_HANDLE) {
+			blocks[i] = block;
+			return i;
+		}
+	}
+	blocks.push_back(block);
+	return static_cast<uint32_t>(blocks.size() - 1);
+}
+
+void MemoryAllocator::free(MemoryAllocation& allocation) {
+	if (allocation.memory == VK_NULL_HANDLE) {
+		return;
+	}
+
+	Block& block = pools[allocation.pool][allocation.block];
+	Range range = { allocation.offset, allocation.size };
+
+	auto next = std::lower_bound(block.freeList.begin(), block.freeList.end(), range,
+		[](const Range& a, const Range& b) { return a.offset < b.offset; });
+	next = block.freeList.insert(next, range);
+
+	// merge with the free neighbours on both sides
+	if (next + 1 != block.freeList.end() &&
+		next->offset + next->size == (next + 1)->offset) {
+		next->size += (next + 1)->size;
+		block.freeList.erase(next + 1);
+	}
+	if (next != block.freeList.begin() &&
+		(next - 1)->offset + (next - 1)->size == next->offset) {
+		(next - 1)->size += next->size;
+		block.freeList.erase(next);
+	}
+
+	block.used -= allocation.size;
+	block.allocations--;
+	allocation.memory = VK_NULL_HANDLE;
+
+	// the first block of every pool is kept around, the others go back to
+	// the driver as soon as they are empty
+	if (block.allocations == 0 && allocation.block > 0) {
+		if (block.mapped != nullptr) {
+			vkUnmapMemory(BP->device, block.memory);
+		}
+		vkFreeMemory(BP->device, block.memory, nullptr);
+		deviceAllocations--;
+		block = Block();
+	}
+}
+
+void *MemoryAllocator::map(const MemoryAllocation& allocation) {
+	// a VkDeviceMemory can only be mapped once, so the whole block is
+	// mapped and every allocation in it gets a pointer at its offset
+	Block& block = pools[allocation.pool][allocation.block];
+	if (block.mapCount++ == 0) {
+		VkResult result = vkMapMemory(BP->device, block.memory, 0, VK_WHOLE_SIZE, 0,
+									  &block.mapped);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to map device memory!");
+		}
+	}
+	return static_cast<char *>(block.mapped) + allocation.offset;
+}
+
+void MemoryAllocator::unmap(const MemoryAllocation& allocation) {
+	Block& block = pools[allocation.pool][allocation.block];
+	if (--block.mapCount == 0) {
+		vkUnmapMemory(BP->device, block.memory);
+		block.mapped = nullptr;
+	}
+}
+
+void MemoryAllocator::printStats() {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+
+	VkDeviceSize totalReserved = 0;
+	VkDeviceSize totalUsed = 0;
+	uint32_t totalAllocations = 0;
+
+	for (uint32_t pool = 0; pool < pools.size(); pool++) {
+		VkDeviceSize reserved = 0;
+		VkDeviceSize used = 0;
+		VkDeviceSize free = 0;
+		VkDeviceSize largestFree = 0;
+		uint32_t blocks = 0;
+		uint32_t allocations = 0;
+		size_t freeRanges = 0;
+
+		for (const Block& block : pools[pool]) {
+			if (block.memory == VK_NULL_HANDLE) {
+				continue;
+			}
+			blocks++;
+			reserved += block.size;
+			used += block.used;
+			allocations += block.allocations;
+			freeRanges += block.freeList.size();
+			for (const Range& range : block.freeList) {
+				free += range.size;
+				largestFree = std::max(largestFree, range.size);
+			}
+		}
+		if (blocks == 0) {
+			continue;
+		}
+
+		// share of the free memory that is not in the largest free range
+		float fragmentation = free > 0 ? 1.0f - (float) largestFree / (float) free : 0.0f;
+		std::cout << "Memory type " << pool / 2 << (pool % 2 ? " images: " : " buffers: ")
+				  << allocations << " allocations in " << blocks << " blocks, "
+				  << used / 1024 << " KB used of " << reserved / 1024 << " KB, "
+				  << freeRanges << " free ranges, fragmentation "
+				  << (int) (fragmentation * 100.0f) << "%" << std::endl;
+
+		totalReserved += reserved;
+		totalUsed += used;
+		totalAllocations += allocations;
+	}
+
+	std::cout << "Memory: " << totalAllocations << " allocations in "
+			  << deviceAllocations << " device allocations (peak "
+			  << peakDeviceAllocations << ", limit "
+			  << properties.limits.maxMemoryAllocationCount << "), "
+			  << totalUsed / 1024 << " KB used of "
+			  << totalReserved / 1024 << " KB" << std::endl;
+}
+
+void MemoryAllocator::cleanup() {
+	for (std::vector<Block>& blocks : pools) {
+		for (Block& block : blocks) {
+			if (block.memory == VK_NULL_HANDLE) {
+				continue;
+			}
+			if (block.mapped != nullptr) {
+				vkUnmapMemory(BP->device, block.memory);
+			}
+			vkFreeMemory(BP->device, block.memory, nullptr);
+		}
+	}
+	pools.clear();
+	deviceAllocations = 0;
+}
+
+void SceneGeometry::init(BaseProject *bp, VkDeviceSize vertexBytes, VkDeviceSize indexBytes) {
+	BP = bp;
+	vertexCapacity = static_cast<uint32_t>(vertexBytes / sizeof(Vertex));
+	indexCapacity = static_cast<uint32_t>(indexBytes / sizeof(uint32_t));
+	vertexCount = 0;
+	indexCount = 0;
+	meshes = 0;
+
+	VkMemoryPropertyFlags properties = BP->deviceLocalGeometry ?
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT :
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	BP->createBuffer(vertexCapacity * sizeof(Vertex),
+					 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 properties, vertexBuffer, vertexBufferMemory);
+	BP->createBuffer(indexCapacity * sizeof(uint32_t),
+					 VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 properties, indexBuffer, indexBufferMemory);
+}
+
+bool SceneGeometry::add(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices,
+						uint32_t& firstIndex, int32_t& vertexOffset) {
+	if (vertices.size() > vertexCapacity - vertexCount ||
+		indices.size() > indexCapacity - indexCount) {
+		return false;
+	}
+
+	BP->uploadToBuffer(vertices.data(), sizeof(Vertex) * vertices.size(),
+					   vertexBuffer, vertexBufferMemory, sizeof(Vertex) * vertexCount);
+	BP->uploadToBuffer(indices.data(), sizeof(uint32_t) * indices.size(),
+					   indexBuffer, indexBufferMemory, sizeof(uint32_t) * indexCount);
+
+	firstIndex = indexCount;
+	vertexOffset = static_cast<int32_t>(vertexCount);
+	vertexCount += static_cast<uint32_t>(vertices.size());
+	indexCount += static_cast<uint32_t>(indices.size());
+	meshes++;
+	return true;
+}
+
+void SceneGeometry::cleanup() {
+	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
+	BP->memoryAllocator.free(indexBufferMemory);
+	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
+	BP->memoryAllocator.free(vertexBufferMemory);
+	vertexCount = 0;
+	indexCount = 0;
+	meshes = 0;
+}
+
+void UniformArena::init(BaseProject *bp, VkDeviceSize size) {
+	BP = bp;
+	this->size = size;
+	head = 0;
+	slices = 0;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 1);
+
+	buffers.resize(BP->swapChainImages.size());
+	buffersMemory.resize(BP->swapChainImages.size());
+	mapped.resize(BP->swapChainImages.size());
+	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+		BP->createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+						 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 buffers[i], buffersMemory[i]);
+		mapped[i] = static_cast<char *>(BP->mapMemory(buffersMemory[i]));
+	}
+}
+
+uint32_t UniformArena::allocate(VkDeviceSize size) {
+	VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+	if (offset + size > this->size) {
+		throw std::runtime_error("uniform arena is full, raise uniformArenaSize!");
+	}
+
+	head = offset + size;
+	slices++;
+	return static_cast<uint32_t>(offset);
+}
+
+void UniformArena::cleanup() {
+	for (size_t i = 0; i < buffers.size(); i++) {
+		vkDestroyBuffer(BP->device, buffers[i], nullptr);
+		BP->unmapMemory(buffersMemory[i]);
+		BP->memoryAllocator.free(buffersMemory[i]);
+	}
+	buffers.clear();
+	buffersMemory.clear();
+	mapped.clear();
+	head = 0;
+	slices = 0;
+}
+
+void DescriptorAllocator::init(BaseProject *bp) {
+	BP = bp;
+	addPool();
+}
+
+void DescriptorAllocator::allocate(const std::vector<VkDescriptorSetLayout>& layouts, VkDescriptorSet *sets) {
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+	allocInfo.pSetLayouts = layouts.data();
+
+	allocInfo.descriptorPool = pools.back();
+	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo, sets);
+	if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL) {
+		addPool();
+		allocInfo.descriptorPool = pools.back();
+		result = vkAllocateDescriptorSets(BP->device, &allocInfo, sets);
+	}
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate descriptor sets!");
+	}
+}
+
+// Room for setsPerPool sets of the layouts the scene uses: one dynamic
+// uniform buffer and one texture each
+void DescriptorAllocator::addPool() {
+	std::array<VkDescriptorPoolSize, 2> poolSizes{};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	poolSizes[0].descriptorCount = setsPerPool;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = setsPerPool;
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = setsPerPool;
+
+	VkDescriptorPool pool;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &pool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create descriptor pool!");
+	}
+	pools.push_back(pool);
+}
+
+void DescriptorAllocator::cleanup() {
+	for (VkDescriptorPool pool : pools) {
+		vkDestroyDescriptorPool(BP->device, pool, nullptr);
+	}
+	pools.clear();
 }
 
 void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-					std::vector<DescriptorSetLayout *> D) {
+					std::vector<DescriptorSetLayout *> D, bool instanced) {
 	BP = bp;
 	
 	auto vertShaderCode = readFile(VertShader);
@@ -1755,13 +3416,23 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType =
 			VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+	std::vector<VkVertexInputBindingDescription> bindingDescriptions =
+			{ Vertex::getBindingDescription() };
+	auto vertexAttributes = Vertex::getAttributeDescriptions();
+	std::vector<VkVertexInputAttributeDescription> attributeDescriptions(
+			vertexAttributes.begin(), vertexAttributes.end());
+	if (instanced) {
+		auto instanceAttributes = InstanceData::getAttributeDescriptions();
+		bindingDescriptions.push_back(InstanceData::getBindingDescription());
+		attributeDescriptions.insert(attributeDescriptions.end(),
+				instanceAttributes.begin(), instanceAttributes.end());
+	}
 			
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	vertexInputInfo.vertexBindingDescriptionCount =
+			static_cast<uint32_t>(bindingDescriptions.size());
 	vertexInputInfo.vertexAttributeDescriptionCount =
 			static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 	vertexInputInfo.pVertexAttributeDescriptions =
 			attributeDescriptions.data();		
 
@@ -1994,52 +3665,33 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 						 std::vector<DescriptorSetElement> E) {
 	BP = bp;
 	
-	// Create uniform buffer
-	uniformBuffers.resize(E.size());
-	uniformBuffersMemory.resize(E.size());
-	toFree.resize(E.size());
+	// Take a slice of the uniform arena for every uniform element
+	uniformBuffersMapped.resize(E.size());
+	std::vector<uint32_t> offsets(E.size(), 0);
 
 	for (int j = 0; j < E.size(); j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
+		uniformBuffersMapped[j].resize(BP->swapChainImages.size(), nullptr);
 		if(E[j].type == UNIFORM) {
+			offsets[j] = BP->uniformArena.allocate(E[j].size);
+			dynamicOffsets.push_back(offsets[j]);
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = E[j].size;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+				uniformBuffersMapped[j][i] = BP->uniformArena.mapped[i] + offsets[j];
 			}
-			toFree[j] = true;
-		} else {
-			toFree[j] = false;
 		}
 	}
 	
 	// Create Descriptor set
 	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
 											   DSL->descriptorSetLayout);
-	VkDescriptorSetAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
-	allocInfo.pSetLayouts = layouts.data();
-	
 	descriptorSets.resize(BP->swapChainImages.size());
-	
-	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
-										descriptorSets.data());
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate descriptor sets!");
-	}
+	BP->descriptorAllocator.allocate(layouts, descriptorSets.data());
 	
 	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 		std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
 		for (int j = 0; j < E.size(); j++) {
 			if(E[j].type == UNIFORM) {
 				VkDescriptorBufferInfo bufferInfo{};
-				bufferInfo.buffer = uniformBuffers[j][i];
+				bufferInfo.buffer = BP->uniformArena.buffers[i];
 				bufferInfo.offset = 0;
 				bufferInfo.range = E[j].size;
 				
@@ -2047,7 +3699,7 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = E[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 				descriptorWrites[j].descriptorCount = 1;
 				descriptorWrites[j].pBufferInfo = &bufferInfo;
 			} else if(E[j].type == TEXTURE) {
@@ -2074,12 +3726,628 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 }
 
 void DescriptorSet::cleanup() {
-	for(int j = 0; j < uniformBuffers.size(); j++) {
-		if(toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
+	// the uniform slices are given back all together by UniformArena::cleanup
+	dynamicOffsets.clear();
+	uniformBuffersMapped.clear();
+}
+
+// Textures one array can hold on the device
+uint32_t TextureArray::capacityOf(VkPhysicalDevice physicalDevice) {
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	return std::min({ MAX_BINDLESS_TEXTURES,
+					  properties.limits.maxPerStageDescriptorSampledImages,
+					  properties.limits.maxPerStageDescriptorSamplers,
+					  properties.limits.maxDescriptorSetSampledImages });
+}
+
+void TextureArray::init(BaseProject *bp) {
+	BP = bp;
+	count = 0;
+	capacity = capacityOf(BP->physicalDevice);
+
+	VkDescriptorSetLayoutBinding binding{};
+	binding.binding = 0;
+	binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	binding.descriptorCount = capacity;
+	binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	binding.pImmutableSamplers = nullptr;
+
+	VkDescriptorBindingFlagsEXT bindingFlags = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo{};
+	bindingFlagsInfo.sType =
+			VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	bindingFlagsInfo.bindingCount = 1;
+	bindingFlagsInfo.pBindingFlags = &bindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.pNext = &bindingFlagsInfo;
+	layoutInfo.bindingCount = 1;
+	layoutInfo.pBindings = &binding;
+
+	layout.BP = BP;
+	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo,
+								nullptr, &layout.descriptorSetLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture array set layout!");
+	}
+
+	// a pool of its own, sized for exactly this one set
+	VkDescriptorPoolSize poolSize{};
+	poolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSize.descriptorCount = capacity;
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = 1;
+
+	result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &descriptorPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture array pool!");
+	}
+
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout.descriptorSetLayout;
+
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, &descriptorSet);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate texture array set!");
+	}
+}
+
+uint32_t TextureArray::add(Texture *texture) {
+	if (count == capacity) {
+		throw std::runtime_error("texture array is full!");
+	}
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = texture->textureImageView;
+	imageInfo.sampler = texture->textureSampler;
+
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = descriptorSet;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.dstArrayElement = count;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+	vkUpdateDescriptorSets(BP->device, 1, &descriptorWrite, 0, nullptr);
+
+	return count++;
+}
+
+void TextureArray::cleanup() {
+	vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+	layout.cleanup();
+	count = 0;
+}
+
+uint32_t FrustumCuller::add(const Model *model, const glm::mat4& worldMat) {
+	minX.push_back(0.0f); minY.push_back(0.0f); minZ.push_back(0.0f);
+	maxX.push_back(0.0f); maxY.push_back(0.0f); maxZ.push_back(0.0f);
+	visible.push_back(1);
+	uint32_t i = static_cast<uint32_t>(visible.size() - 1);
+	set(i, model, worldMat);
+	return i;
+}
+
+// Refits box i around the model placed by worldMat, for objects that move
+void FrustumCuller::set(uint32_t i, const Model *model, const glm::mat4& worldMat) {
+	glm::vec3 lo(std::numeric_limits<float>::max());
+	glm::vec3 hi(std::numeric_limits<float>::lowest());
+	for (const Vertex& vertex : model->vertices) {
+		glm::vec3 pos = glm::vec3(worldMat * glm::vec4(vertex.pos, 1.0f));
+		lo = glm::min(lo, pos);
+		hi = glm::max(hi, pos);
+	}
+
+	minX[i] = lo.x; minY[i] = lo.y; minZ[i] = lo.z;
+	maxX[i] = hi.x; maxY[i] = hi.y; maxZ[i] = hi.z;
+}
+
+// A box is outside when its corner farthest along the normal of one of the
+// clip planes (Gribb-Hartmann, depth in [0, 1]) is behind that plane.
+void FrustumCuller::cull(const glm::mat4& viewProj) {
+	glm::vec4 row[4];
+	for (int r = 0; r < 4; r++) {
+		row[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+	}
+	const glm::vec4 planes[6] = {
+		row[3] + row[0], row[3] - row[0],	// left, right
+		row[3] + row[1], row[3] - row[1],	// bottom, top
+		row[2],          row[3] - row[2]	// near, far
+	};
+
+	const size_t count = visible.size();
+	size_t i = 0;
+
+#if SIMD_WIDTH == 8
+	for (; i + 8 <= count; i += 8) {
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (const glm::vec4& plane : planes) {
+			__m256 x = _mm256_loadu_ps(plane.x >= 0.0f ? &maxX[i] : &minX[i]);
+			__m256 y = _mm256_loadu_ps(plane.y >= 0.0f ? &maxY[i] : &minY[i]);
+			__m256 z = _mm256_loadu_ps(plane.z >= 0.0f ? &maxZ[i] : &minZ[i]);
+			__m256 d = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(plane.x)),
+							  _mm256_mul_ps(y, _mm256_set1_ps(plane.y))),
+				_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(plane.z)),
+							  _mm256_set1_ps(plane.w)));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+		int mask = _mm256_movemask_ps(inside);
+		for (int k = 0; k < 8; k++) {
+			visible[i + k] = (mask >> k) & 1;
+		}
+	}
+#endif
+#if SIMD_WIDTH >= 4
+	for (; i + 4 <= count; i += 4) {
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (const glm::vec4& plane : planes) {
+			__m128 x = _mm_loadu_ps(plane.x >= 0.0f ? &maxX[i] : &minX[i]);
+			__m128 y = _mm_loadu_ps(plane.y >= 0.0f ? &maxY[i] : &minY[i]);
+			__m128 z = _mm_loadu_ps(plane.z >= 0.0f ? &maxZ[i] : &minZ[i]);
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)),
+						   _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)),
+						   _mm_set1_ps(plane.w)));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (int k = 0; k < 4; k++) {
+			visible[i + k] = (mask >> k) & 1;
+		}
+	}
+#endif
+	for (; i < count; i++) {
+		bool inside = true;
+		for (const glm::vec4& plane : planes) {
+			float x = plane.x >= 0.0f ? maxX[i] : minX[i];
+			float y = plane.y >= 0.0f ? maxY[i] : minY[i];
+			float z = plane.z >= 0.0f ? maxZ[i] : minZ[i];
+			inside = inside && plane.x * x + plane.y * y + plane.z * z + plane.w >= 0.0f;
+		}
+		visible[i] = inside;
+	}
+
+	culled = static_cast<uint32_t>(std::count(visible.begin(), visible.end(), 0));
+}
+
+void FrustumCuller::clear() {
+	minX.clear(); minY.clear(); minZ.clear();
+	maxX.clear(); maxY.clear(); maxZ.clear();
+	visible.clear();
+	culled = 0;
+}
+
+void InstanceBatches::init(BaseProject *bp, FrustumCuller *culler) {
+	BP = bp;
+	this->culler = culler;
+	batches.clear();
+	instanceCount = 0;
+	bindless = BP->bindlessTextures;
+}
+
+uint32_t InstanceBatches::add(Model *model, Texture *texture, DescriptorSet *descSet,
+							  const PushConstantObject& pco, uint32_t bounds) {
+	InstanceData instance;
+	instance.worldMat = pco.worldMat;
+	instance.reflectance = pco.reflectance;
+	instance.textureIndex = texture->arrayIndex;
+	uint32_t id = instanceCount++;
+
+	for (Batch& batch : batches) {
+		if (batch.model == model && (bindless || batch.texture == texture)) {
+			batch.instances.push_back(instance);
+			batch.bounds.push_back(bounds);
+			batch.ids.push_back(id);
+			return id;
+		}
+	}
+	batches.push_back({ model, texture, descSet, { instance }, { bounds }, { id }, 0, 1 });
+	return id;
+}
+
+// Moves an instance: drawn from the next cull(), so only with a culler
+void InstanceBatches::setWorld(uint32_t id, const glm::mat4& worldMat) {
+	batches[locations[id].x].instances[locations[id].y].worldMat = worldMat;
+}
+
+void InstanceBatches::upload() {
+	// batches binding the same texture next to each other, so that they
+	// can share one indirect call
+	std::stable_sort(batches.begin(), batches.end(),
+		[](const Batch& a, const Batch& b) { return a.texture < b.texture; });
+
+	std::vector<InstanceData> instances;
+	std::vector<VkDrawIndexedIndirectCommand> commands;
+	instances.reserve(instanceCount);
+	runs.clear();
+	indirect = BP->drawIndirectFirstInstance;
+
+	locations.resize(instanceCount);
+	for (uint32_t b = 0; b < batches.size(); b++) {
+		for (uint32_t i = 0; i < batches[b].ids.size(); i++) {
+			locations[batches[b].ids[i]] = glm::uvec2(b, i);
+		}
+	}
+
+	for (Batch& batch : batches) {
+		batch.firstInstance = static_cast<uint32_t>(instances.size());
+		batch.visibleInstances = static_cast<uint32_t>(batch.instances.size());
+		instances.insert(instances.end(), batch.instances.begin(), batch.instances.end());
+
+		VkDrawIndexedIndirectCommand command{};
+		command.indexCount = static_cast<uint32_t>(batch.model->indices.size());
+		command.instanceCount = static_cast<uint32_t>(batch.instances.size());
+		command.firstIndex = batch.model->firstIndex;
+		command.vertexOffset = batch.model->vertexOffset;
+		command.firstInstance = batch.firstInstance;
+		commands.push_back(command);
+
+		// one bound vertex buffer for all the draws of the indirect path
+		indirect = indirect && batch.model->sharedBuffers;
+
+		if (!runs.empty() && (bindless ||
+				batches[runs.back().firstDraw].texture == batch.texture)) {
+			runs.back().drawCount++;
+		} else {
+			runs.push_back({ batch.descSet, static_cast<uint32_t>(commands.size() - 1), 1 });
+		}
+	}
+	if (instances.empty()) {
+		return;
+	}
+
+	if (culler != nullptr) {
+		// rewritten by cull() for the image being recorded, so one copy per
+		// swapchain image; until then every instance is drawn
+		VkDeviceSize instanceBytes = sizeof(InstanceData) * instances.size();
+		VkDeviceSize commandBytes = sizeof(VkDrawIndexedIndirectCommand) * commands.size();
+		commandsOffset = (instanceBytes + 15) / 16 * 16;
+
+		frameBuffers.resize(BP->swapChainImages.size());
+		frameBuffersMemory.resize(BP->swapChainImages.size());
+		frameMapped.resize(BP->swapChainImages.size());
+		for (size_t i = 0; i < frameBuffers.size(); i++) {
+			BP->createBuffer(commandsOffset + commandBytes,
+							 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+							 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							 frameBuffers[i], frameBuffersMemory[i]);
+			frameMapped[i] = static_cast<char *>(BP->mapMemory(frameBuffersMemory[i]));
+			memcpy(frameMapped[i], instances.data(), instanceBytes);
+			memcpy(frameMapped[i] + commandsOffset, commands.data(), commandBytes);
+		}
+	} else {
+		BP->createStaticBuffer(instances.data(), sizeof(InstanceData) * instances.size(),
+							   VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+							   instanceBuffer, instanceBufferMemory);
+		if (indirect) {
+			BP->createStaticBuffer(commands.data(),
+								   sizeof(VkDrawIndexedIndirectCommand) * commands.size(),
+								   VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+								   indirectBuffer, indirectBufferMemory);
+		}
+	}
+
+	std::cout << "Instancing: " << instanceCount << " objects in "
+			  << batches.size() << " draws";
+	if (indirect) {
+		std::cout << ", " << (BP->multiDrawIndirect ? runs.size() : batches.size())
+				  << " indirect calls";
+	}
+	std::cout << std::endl;
+}
+
+// Packs the instances whose box passed the last FrustumCuller::cull at the
+// start of their batch's range, in the buffer of currentImage. The caller
+// must have waited for the last submission that read that image's buffer.
+void InstanceBatches::cull(int currentImage) {
+	if (culler == nullptr || frameMapped.empty()) {
+		return;
+	}
+
+	InstanceData *instances = reinterpret_cast<InstanceData *>(frameMapped[currentImage]);
+	VkDrawIndexedIndirectCommand *commands = reinterpret_cast<VkDrawIndexedIndirectCommand *>(
+			frameMapped[currentImage] + commandsOffset);
+
+	for (size_t b = 0; b < batches.size(); b++) {
+		Batch& batch = batches[b];
+		uint32_t count = 0;
+		for (size_t i = 0; i < batch.instances.size(); i++) {
+			if (culler->visible[batch.bounds[i]]) {
+				instances[batch.firstInstance + count++] = batch.instances[i];
 			}
 		}
+		batch.visibleInstances = count;
+		commands[b].instanceCount = count;
 	}
+}
+
+void InstanceBatches::draw(VkCommandBuffer commandBuffer, int currentImage,
+						   VkPipelineLayout pipelineLayout, uint32_t set) {
+	VkDeviceSize offsets[] = { 0, 0 };
+	VkBuffer instances = instanceBuffer;
+	VkBuffer commands = indirectBuffer;
+	VkDeviceSize commandsBase = 0;
+	if (culler != nullptr && !frameBuffers.empty()) {
+		instances = frameBuffers[currentImage];
+		commands = frameBuffers[currentImage];
+		commandsBase = commandsOffset;
+	}
+
+	if (indirect) {
+		VkBuffer vertexBuffers[] = { BP->sceneGeometry.vertexBuffer, instances };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+		vkCmdBindIndexBuffer(commandBuffer, BP->sceneGeometry.indexBuffer, 0,
+							 VK_INDEX_TYPE_UINT32);
+
+		if (bindless) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				pipelineLayout, set, 1, &BP->textureArray.descriptorSet, 0, nullptr);
+		}
+
+		for (Run& run : runs) {
+			if (!bindless) {
+				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+					pipelineLayout, set, 1, &run.descSet->descriptorSets[currentImage],
+					static_cast<uint32_t>(run.descSet->dynamicOffsets.size()),
+					run.descSet->dynamicOffsets.data());
+			}
+
+			// without multiDrawIndirect the draw count must be 1
+			if (BP->multiDrawIndirect) {
+				vkCmdDrawIndexedIndirect(commandBuffer, commands,
+						commandsBase + run.firstDraw * sizeof(VkDrawIndexedIndirectCommand),
+						run.drawCount, sizeof(VkDrawIndexedIndirectCommand));
+			} else {
+				for (uint32_t i = 0; i < run.drawCount; i++) {
+					vkCmdDrawIndexedIndirect(commandBuffer, commands,
+							commandsBase + (run.firstDraw + i) * sizeof(VkDrawIndexedIndirectCommand),
+							1, sizeof(VkDrawIndexedIndirectCommand));
+				}
+			}
+		}
+		return;
+	}
+
+	if (bindless) {
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			pipelineLayout, set, 1, &BP->textureArray.descriptorSet, 0, nullptr);
+	}
+
+	for (Batch& batch : batches) {
+		if (batch.visibleInstances == 0) {
+			continue;
+		}
+
+		VkBuffer vertexBuffers[] = { batch.model->vertexBuffer, instances };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+		vkCmdBindIndexBuffer(commandBuffer, batch.model->indexBuffer, 0,
+							 VK_INDEX_TYPE_UINT32);
+		if (!bindless) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				pipelineLayout, set, 1, &batch.descSet->descriptorSets[currentImage],
+				static_cast<uint32_t>(batch.descSet->dynamicOffsets.size()),
+				batch.descSet->dynamicOffsets.data());
+		}
+
+		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(batch.model->indices.size()),
+						 batch.visibleInstances,
+						 batch.model->firstIndex, batch.model->vertexOffset,
+						 batch.firstInstance);
+	}
+}
+
+void InstanceBatches::cleanup() {
+	if (instanceBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, instanceBuffer, nullptr);
+		BP->memoryAllocator.free(instanceBufferMemory);
+		instanceBuffer = VK_NULL_HANDLE;
+	}
+	if (indirectBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, indirectBuffer, nullptr);
+		BP->memoryAllocator.free(indirectBufferMemory);
+		indirectBuffer = VK_NULL_HANDLE;
+	}
+	for (size_t i = 0; i < frameBuffers.size(); i++) {
+		vkDestroyBuffer(BP->device, frameBuffers[i], nullptr);
+		BP->unmapMemory(frameBuffersMemory[i]);
+		BP->memoryAllocator.free(frameBuffersMemory[i]);
+	}
+	frameBuffers.clear();
+	frameBuffersMemory.clear();
+	frameMapped.clear();
+	batches.clear();
+	locations.clear();
+	runs.clear();
+	instanceCount = 0;
+}
+
+void RenderQueue::addPipeline(Pipeline *pipeline, DescriptorSet *global) {
+	if (pipelineIds.count(pipeline) == 0) {
+		pipelineIds[pipeline] = static_cast<uint32_t>(globalSets.size());
+		globalSets.push_back(global);
+	} else {
+		globalSets[pipelineIds[pipeline]] = global;
+	}
+}
+
+void RenderQueue::clear() {
+	packets.clear();
+	order.clear();
+}
+
+uint64_t RenderQueue::makeKey(uint32_t layer, Pipeline *pipeline, const void *shared,
+							  const void *mesh, float depth) {
+	auto id = [](std::unordered_map<const void *, uint32_t>& ids, const void *object) {
+		if (object == nullptr) {
+			return 0u;
+		}
+		auto found = ids.find(object);
+		if (found != ids.end()) {
+			return found->second;
+		}
+		uint32_t next = static_cast<uint32_t>(ids.size()) + 1;
+		ids[object] = next;
+		return next;
+	};
+
+	if (pipeline != nullptr && pipelineIds.count(pipeline) == 0) {
+		addPipeline(pipeline, nullptr);
+	}
+	uint64_t pipelineId = pipeline == nullptr ? 0xff : pipelineIds[pipeline];
+
+	// blending depends on the order overlays are drawn in: keep it
+	if (layer >= LAYER_OVERLAY) {
+		return (static_cast<uint64_t>(layer & 0xf) << 60) | order.size();
+	}
+
+	uint64_t depthBits = static_cast<uint64_t>(
+		glm::clamp(depth / depthRange, 0.0f, 1.0f) * 65535.0f);
+
+	return (static_cast<uint64_t>(layer & 0xf) << 60) |
+		   ((pipelineId & 0xff) << 52) |
+		   ((static_cast<uint64_t>(id(materialIds, shared)) & 0xfffff) << 32) |
+		   ((static_cast<uint64_t>(id(meshIds, mesh)) & 0xffff) << 16) |
+		   depthBits;
+}
+
+void RenderQueue::submit(uint32_t layer, Pipeline *pipeline, DescriptorSet *material,
+						 uint32_t materialSet, VkBuffer vertexBuffer, VkBuffer indexBuffer,
+						 uint32_t indexCount, uint32_t firstIndex, int32_t vertexOffset,
+						 const PushConstantObject *pco, float depth, const void *shared) {
+	DrawPacket packet{};
+	packet.key = makeKey(layer, pipeline, shared, vertexBuffer, depth);
+	packet.pipeline = pipeline;
+	packet.global = pipeline != nullptr ? globalSets[pipelineIds[pipeline]] : nullptr;
+	packet.material = material;
+	packet.materialSet = materialSet;
+	packet.vertexBuffer = vertexBuffer;
+	packet.indexBuffer = indexBuffer;
+	packet.indexCount = indexCount;
+	packet.firstIndex = firstIndex;
+	packet.vertexOffset = vertexOffset;
+	packet.hasPushConstants = pco != nullptr;
+	if (pco != nullptr) {
+		packet.pco = *pco;
+	}
+	order.push_back({ packet.key, static_cast<uint32_t>(packets.size()) });
+	packets.push_back(std::move(packet));
+}
+
+void RenderQueue::submitCustom(uint32_t layer, Pipeline *pipeline, float depth,
+							   std::function<void(VkCommandBuffer, int)> record) {
+	DrawPacket packet{};
+	packet.key = makeKey(layer, pipeline, nullptr, nullptr, depth);
+	packet.pipeline = pipeline;
+	packet.global = pipeline != nullptr ? globalSets[pipelineIds[pipeline]] : nullptr;
+	packet.custom = std::move(record);
+	order.push_back({ packet.key, static_cast<uint32_t>(packets.size()) });
+	packets.push_back(std::move(packet));
+}
+
+// equal keys keep their submission order
+void RenderQueue::sort() {
+	std::stable_sort(order.begin(), order.end(),
+		[](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+			return a.first < b.first;
+		});
+}
+
+void RenderQueue::record(VkCommandBuffer commandBuffer, int currentImage, size_t first, size_t last) {
+	// a command buffer starts with nothing bound
+	Pipeline *pipeline = nullptr;
+	DescriptorSet *material = nullptr;
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	uint32_t issued = 0;
+	uint32_t avoided = 0;
+
+	for (size_t i = first; i < last; i++) {
+		DrawPacket& packet = packets[order[i].second];
+
+		if (packet.pipeline != nullptr && packet.pipeline != pipeline) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							  packet.pipeline->graphicsPipeline);
+			issued++;
+			DescriptorSet *global = packet.global;
+			if (global != nullptr) {
+				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+					packet.pipeline->pipelineLayout, 0, 1, &global->descriptorSets[currentImage],
+					static_cast<uint32_t>(global->dynamicOffsets.size()),
+					global->dynamicOffsets.data());
+				issued++;
+			}
+			material = nullptr;
+		} else if (packet.pipeline != nullptr) {
+			avoided += packet.global != nullptr ? 2 : 1;
+		}
+		pipeline = packet.pipeline;
+
+		if (packet.custom) {
+			packet.custom(commandBuffer, currentImage);
+			// whatever it bound is unknown from here on
+			if (packet.pipeline == nullptr) {
+				pipeline = nullptr;
+			}
+			material = nullptr;
+			vertexBuffer = VK_NULL_HANDLE;
+			indexBuffer = VK_NULL_HANDLE;
+			continue;
+		}
+
+		if (packet.material != nullptr && packet.material != material) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				packet.pipeline->pipelineLayout, packet.materialSet, 1,
+				&packet.material->descriptorSets[currentImage],
+				static_cast<uint32_t>(packet.material->dynamicOffsets.size()),
+				packet.material->dynamicOffsets.data());
+			material = packet.material;
+			issued++;
+		} else if (packet.material != nullptr) {
+			avoided++;
+		}
+
+		if (packet.vertexBuffer != vertexBuffer) {
+			VkDeviceSize offsets[] = { 0 };
+			vkCmdBindVertexBuffers(commandBuffer, 0, 1, &packet.vertexBuffer, offsets);
+			vertexBuffer = packet.vertexBuffer;
+			issued++;
+		} else {
+			avoided++;
+		}
+		if (packet.indexBuffer != indexBuffer) {
+			vkCmdBindIndexBuffer(commandBuffer, packet.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+			indexBuffer = packet.indexBuffer;
+			issued++;
+		} else {
+			avoided++;
+		}
+
+		if (packet.hasPushConstants) {
+			vkCmdPushConstants(commandBuffer, packet.pipeline->pipelineLayout,
+				VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstantObject), &packet.pco);
+		}
+		vkCmdDrawIndexed(commandBuffer, packet.indexCount, 1,
+						 packet.firstIndex, packet.vertexOffset, 0);
+	}
+
+	binds += issued;
+	bindsAvoided += avoided;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 %VULKAN_SDK%/Bin/glslc.exe shader.frag -o frag.spv
+%VULKAN_SDK%/Bin/glslc.exe bindless.frag -o bindlessFrag.spv
 %VULKAN_SDK%/Bin/glslc.exe shader.vert -o vert.spv
+%VULKAN_SDK%/Bin/glslc.exe instanced.vert -o instancedVert.spv
 %VULKAN_SDK%/Bin/glslc.exe skybox.frag -o skyboxFrag.spv
 %VULKAN_SDK%/Bin/glslc.exe skybox.vert -o skyboxVert.spv
 %VULKAN_SDK%/Bin/glslc.exe textShader.frag -o textFrag.spv
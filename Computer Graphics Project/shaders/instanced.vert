@@ -0,0 +1,36 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+	vec3 lightPos[11];
+	vec3 lightColor;
+	vec3 sunLightDir;
+	vec3 sunLightColor;
+	vec4 coneInOutDecayExp;
+} gubo;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+// per instance, from the instance rate vertex buffer (InstanceData)
+layout(location = 3) in mat4 instanceWorldMat;
+layout(location = 7) in float instanceReflectance;
+layout(location = 8) in uint instanceTextureIndex;
+
+layout(location = 0) out vec3 fragPos;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out float reflectance;
+layout(location = 4) flat out uint textureIndex;
+
+
+void main() {
+	gl_Position = gubo.proj * gubo.view * instanceWorldMat * vec4(pos, 1.0);
+	fragPos = (instanceWorldMat* vec4(pos,  1.0)).xyz;
+	fragNorm = (instanceWorldMat * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	reflectance = instanceReflectance;
+	textureIndex = instanceTextureIndex;
+}
\ No newline at end of file